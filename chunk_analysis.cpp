@@ -0,0 +1,448 @@
+#include "chunk_analysis.h"
+
+#include <iterator>
+#include <limits>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+    constexpr std::array<std::uint64_t, 256> make_gear_table()
+    {
+        std::array<std::uint64_t, 256> table{};
+        std::uint64_t state = 0x9e3779b97f4a7c15ull;
+        for (auto& value : table) {
+            state += 0x9e3779b97f4a7c15ull;
+            std::uint64_t z = state;
+            z = (z ^ (z >> 30u)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27u)) * 0x94d049bb133111ebull;
+            value = z ^ (z >> 31u);
+        }
+        return table;
+    }
+
+    // What malloc takes for a block of `size` bytes: an 8-byte header, rounded up to 16 bytes,
+    // and 32 bytes at least.
+    constexpr std::size_t heap_bytes(std::size_t size)
+    {
+        return size == 0 ? 0 : std::max<std::size_t>((size + 8 + 15) / 16 * 16, 32);
+    }
+
+    // A node of an unordered container: the next pointer, the value and, unless the hash is
+    // trivial, the cached hash code. Bucket arrays are counted separately.
+    template<typename Value, bool cached_hash>
+    constexpr std::size_t node_bytes_of = heap_bytes(sizeof(void*) + sizeof(Value) + (cached_hash ? sizeof(std::size_t) : 0));
+
+    // An index entry is a fingerprint and two 32-bit words; a pair of report() also takes
+    // a bucket.
+    constexpr std::size_t entry_node = node_bytes_of<std::pair<std::uint64_t const, std::uint64_t>, false>;
+    constexpr std::size_t content_node = node_bytes_of<std::pair<sha256_digest const, std::uint32_t>, true>;
+    constexpr std::size_t pair_bytes = node_bytes_of<std::pair<std::uint64_t const, std::uintmax_t>, false> + sizeof(void*);
+
+    std::size_t string_bytes(std::string const& value)
+    {
+        // Short strings are stored inline.
+        return value.size() < sizeof(std::string) / 2 ? 0 : heap_bytes(value.size() + 1);
+    }
+
+    // libstdc++ keeps a path's components in a separate block next to its string.
+    std::size_t path_bytes(fs::path const& path)
+    {
+        auto components = static_cast<std::size_t>(std::distance(path.begin(), path.end()));
+        auto result = string_bytes(path.native());
+        if (components > 1) {
+            result += heap_bytes(2 * sizeof(int) + components * (sizeof(fs::path) + sizeof(std::size_t)));
+            for (auto& component : path) {
+                result += string_bytes(component.native());
+            }
+        }
+        return result;
+    }
+
+    std::uint64_t finalize(std::uint64_t h)
+    {
+        h ^= h >> 33u;
+        h *= 0xc2b2ae3d27d4eb4full;
+        h ^= h >> 29u;
+        h *= 0x165667b19e3779f9ull;
+        return h ^ (h >> 32u);
+    }
+
+}
+
+std::array<std::uint64_t, 256> const content_defined_chunker::gear_table = make_gear_table();
+
+std::uint64_t content_defined_chunker::mark_candidates(unsigned char const* data, std::size_t size,
+        std::uint64_t gear, std::vector<std::uint64_t>& candidates)
+{
+    // Either mask can only be satisfied where the bits they share are clear. That is rare
+    // enough for a single test to dismiss nearly every position, which keeps the loop at
+    // about a byte per cycle.
+    constexpr auto shared = mask_small & mask_large;
+    for (std::size_t i = 0; i < size; ++i) {
+        gear = (gear << 1u) + gear_table[data[i]];
+        if ((gear & shared) == 0) {
+            auto flags = ((gear & mask_small) == 0 ? cut_small : 0u) | ((gear & mask_large) == 0 ? cut_large : 0u);
+            if (flags != 0) {
+                candidates.push_back(std::uint64_t(i) << 2u | flags);
+            }
+        }
+    }
+    return gear;
+}
+
+std::uint64_t content_defined_chunker::chunk_hasher::finish() const
+{
+    std::uint64_t h = total * 0x9e3779b97f4a7c15ull;
+    for (auto lane : lanes) {
+        h = (h ^ round(0, lane)) * 0x9e3779b185ebca87ull + 0x85ebca77c2b2ae63ull;
+    }
+    std::size_t i = 0;
+    for (; i + 8 <= pending_size; i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, pending.data() + i, sizeof(word));
+        h ^= round(0, word);
+        h = ((h << 27u) | (h >> 37u)) * 0x9e3779b185ebca87ull + 0x85ebca77c2b2ae63ull;
+    }
+    for (; i < pending_size; ++i) {
+        h ^= pending[i] * 0x27d4eb2f165667c5ull;
+        h = ((h << 11u) | (h >> 53u)) * 0x9e3779b185ebca87ull;
+    }
+    return finalize(h);
+}
+
+chunk_analysis::file_chunks::file_chunks(chunk_analysis const& analysis)
+        :analysis(analysis), capacity(2)
+{
+    // A power of two, so that the vector stops growing at exactly `capacity` chunks. A few
+    // files are read at once, each taking up to 1/32 of the limit.
+    while (capacity * 2 * sizeof(chunk) <= analysis.options.memory_limit / 32) {
+        capacity *= 2;
+    }
+}
+
+void chunk_analysis::file_chunks::add(std::uint64_t fingerprint, std::size_t length)
+{
+    shift = std::max(shift, analysis.sample_shift.load());
+    if (!sampled(fingerprint, shift)) {
+        return;
+    }
+    chunks.push_back({fingerprint, static_cast<std::uint32_t>(length)});
+    if (chunks.size() < capacity) {
+        return;
+    }
+    std::sort(chunks.begin(), chunks.end(), [](chunk const& a, chunk const& b) {
+        return a.fingerprint < b.fingerprint;
+    });
+    chunks.erase(std::unique(chunks.begin(), chunks.end(), [](chunk const& a, chunk const& b) {
+        return a.fingerprint == b.fingerprint;
+    }), chunks.end());
+    while (chunks.size() > capacity / 2 && shift < 63) {
+        ++shift;
+        chunks.erase(std::remove_if(chunks.begin(), chunks.end(), [this](chunk const& c) {
+            return !sampled(c.fingerprint, shift);
+        }), chunks.end());
+    }
+}
+
+std::size_t chunk_analysis::digest_hash::operator()(sha256_digest const& digest) const
+{
+    std::size_t result;
+    std::memcpy(&result, digest.data(), sizeof(result));
+    return result;
+}
+
+chunk_analysis::chunk_analysis(chunk_analysis_options options)
+        :options(options) { }
+
+bool chunk_analysis::sampled(std::uint64_t fingerprint, unsigned shift)
+{
+    // Fingerprints are finalized, so their top bits are as good as any for sampling.
+    return shift == 0 || (fingerprint >> (64u - shift)) == 0;
+}
+
+std::size_t chunk_analysis::used() const
+{
+    return node_bytes
+            + (index.bucket_count() + content_ids.bucket_count()) * sizeof(void*)
+            + sets.capacity() * sizeof(content_set) + free_sets.capacity() * sizeof(std::uint32_t)
+            + paths.capacity() * sizeof(std::string);
+}
+
+void chunk_analysis::add_file(fs::path const& path, sha256_digest const& hash, file_chunks chunks)
+{
+    auto& list = chunks.chunks;
+    std::sort(list.begin(), list.end(), [](chunk const& a, chunk const& b) {
+        return a.fingerprint < b.fingerprint;
+    });
+    list.erase(std::unique(list.begin(), list.end(), [](chunk const& a, chunk const& b) {
+        return a.fingerprint == b.fingerprint;
+    }), list.end());
+
+    std::lock_guard<std::mutex> lg(mtx);
+    if (chunks.shift > sample_shift) {
+        narrow(chunks.shift);
+    }
+    list.erase(std::remove_if(list.begin(), list.end(), [shift = sample_shift.load()](chunk const& c) {
+        return !sampled(c.fingerprint, shift);
+    }), list.end());
+    // Identical copies are already represented by the first of them.
+    if (list.empty() || content_ids.count(hash) != 0) {
+        return;
+    }
+    auto content = static_cast<std::uint32_t>(paths.size());
+    content_ids.emplace(hash, content);
+    paths.push_back(path.string());
+    node_bytes += content_node + string_bytes(paths.back());
+
+    // All chunks of the file that are in one set move on to the same set. A set held by
+    // nothing else takes the new content itself, so that a chunk found in every file does
+    // not cost a copy of an ever longer set per file.
+    struct transition {
+        std::uint32_t holders = 0;
+        bool moved = false;
+        std::uint32_t set = 0;
+    };
+    std::unordered_map<std::uint32_t, transition> transitions;
+    for (auto& c : list) {
+        if (auto it = index.find(c.fingerprint); it != index.end()) {
+            ++transitions[it->second.set].holders;
+        }
+    }
+    for (auto& c : list) {
+        auto [it, inserted] = index.try_emplace(c.fingerprint, entry{c.length, single_content | content});
+        if (inserted) {
+            node_bytes += entry_node;
+            continue;
+        }
+        auto& e = it->second;
+        auto& t = transitions[e.set];
+        if (!t.moved) {
+            t.moved = true;
+            if (!(e.set & single_content) && sets[e.set].refs == t.holders) {
+                auto& contents = sets[e.set].contents;
+                node_bytes -= heap_bytes(contents.capacity() * sizeof(std::uint32_t));
+                contents.push_back(content);
+                node_bytes += heap_bytes(contents.capacity() * sizeof(std::uint32_t));
+                t.set = e.set;
+            } else {
+                t.set = new_set(e.set, content);
+            }
+        }
+        if (t.set != e.set) {
+            ++sets[t.set].refs;
+            release(e.set);
+            e.set = t.set;
+        }
+    }
+    if (used() > options.memory_limit / 2) {
+        shrink();
+    }
+}
+
+// A new, unreferenced set of `set`'s contents and `content`, which is newer than all of them.
+std::uint32_t chunk_analysis::new_set(std::uint32_t set, std::uint32_t content)
+{
+    std::vector<std::uint32_t> contents;
+    if (set & single_content) {
+        contents.reserve(2);
+        contents.push_back(set & ~single_content);
+    } else {
+        contents.reserve(sets[set].contents.size() + 1);
+        contents = sets[set].contents;
+    }
+    contents.push_back(content);
+    node_bytes += heap_bytes(contents.capacity() * sizeof(std::uint32_t));
+    if (free_sets.empty()) {
+        sets.push_back({std::move(contents), 0});
+        return static_cast<std::uint32_t>(sets.size() - 1);
+    }
+    auto id = free_sets.back();
+    free_sets.pop_back();
+    sets[id] = {std::move(contents), 0};
+    return id;
+}
+
+void chunk_analysis::release(std::uint32_t set)
+{
+    if ((set & single_content) || --sets[set].refs > 0) {
+        return;
+    }
+    node_bytes -= heap_bytes(sets[set].contents.capacity() * sizeof(std::uint32_t));
+    sets[set].contents = {};
+    free_sets.push_back(set);
+}
+
+// Narrows the sample to `shift`. Contents no longer referred to by any chunk are dropped,
+// and the remaining contents and sets renumbered in their order.
+void chunk_analysis::narrow(unsigned shift)
+{
+    sample_shift = shift;
+    for (auto it = index.begin(); it != index.end();) {
+        if (sampled(it->first, shift)) {
+            ++it;
+        } else {
+            release(it->second.set);
+            node_bytes -= entry_node;
+            it = index.erase(it);
+        }
+    }
+
+    constexpr auto dropped = std::numeric_limits<std::uint32_t>::max();
+    std::vector<std::uint32_t> content_numbers(paths.size(), dropped);
+    std::vector<std::uint32_t> set_numbers(sets.size(), dropped);
+    for (auto& [fingerprint, e] : index) {
+        if (e.set & single_content) {
+            content_numbers[e.set & ~single_content] = 0;
+        } else {
+            set_numbers[e.set] = 0;
+        }
+    }
+    for (std::size_t set = 0; set < sets.size(); ++set) {
+        if (set_numbers[set] != dropped) {
+            for (auto content : sets[set].contents) {
+                content_numbers[content] = 0;
+            }
+        }
+    }
+
+    std::vector<std::string> kept_paths;
+    kept_paths.reserve(static_cast<std::size_t>(
+            std::count_if(content_numbers.begin(), content_numbers.end(), [](std::uint32_t n) { return n != dropped; })));
+    for (std::size_t content = 0; content < paths.size(); ++content) {
+        if (content_numbers[content] != dropped) {
+            content_numbers[content] = static_cast<std::uint32_t>(kept_paths.size());
+            kept_paths.push_back(std::move(paths[content]));
+        } else {
+            node_bytes -= content_node + string_bytes(paths[content]);
+        }
+    }
+    paths = std::move(kept_paths);
+    for (auto it = content_ids.begin(); it != content_ids.end();) {
+        if (content_numbers[it->second] == dropped) {
+            it = content_ids.erase(it);
+        } else {
+            it->second = content_numbers[it->second];
+            ++it;
+        }
+    }
+
+    std::vector<content_set> kept_sets;
+    kept_sets.reserve(static_cast<std::size_t>(
+            std::count_if(set_numbers.begin(), set_numbers.end(), [](std::uint32_t n) { return n != dropped; })));
+    for (std::size_t set = 0; set < sets.size(); ++set) {
+        if (set_numbers[set] == dropped) {
+            continue;
+        }
+        set_numbers[set] = static_cast<std::uint32_t>(kept_sets.size());
+        for (auto& content : sets[set].contents) {
+            content = content_numbers[content];
+        }
+        kept_sets.push_back(std::move(sets[set]));
+    }
+    sets = std::move(kept_sets);
+    free_sets = {};
+    for (auto& [fingerprint, e] : index) {
+        e.set = (e.set & single_content) ? single_content | content_numbers[e.set & ~single_content] : set_numbers[e.set];
+    }
+
+    // Bucket arrays do not shrink on their own.
+    index.rehash(0);
+    content_ids.rehash(0);
+}
+
+// Halves the sample until the index and the contents it refers to take at most half of
+// their half of the memory limit, so that the next shrink is as many files away.
+void chunk_analysis::shrink()
+{
+    while (used() > options.memory_limit / 4 && sample_shift < 63) {
+        narrow(sample_shift + 1);
+    }
+}
+
+std::vector<shared_chunks> chunk_analysis::report() const
+{
+    std::lock_guard<std::mutex> lg(mtx);
+    std::vector<std::uintmax_t> set_bytes(sets.size());
+    for (auto& [fingerprint, e] : index) {
+        if (!(e.set & single_content)) {
+            set_bytes[e.set] += e.length;
+        }
+    }
+
+    // Results get the other half of the memory limit: a quarter for the pairs accumulated here
+    // and a quarter for the rows returned. When pairs outgrow theirs, only those with the most
+    // shared bytes so far are kept, so the result is an approximate top list.
+    auto max_pairs = std::max<std::size_t>(options.memory_limit / 4 / pair_bytes, 2);
+    std::unordered_map<std::uint64_t, std::uintmax_t> pairs;
+    auto keep_largest = [&pairs](std::size_t count) {
+        std::vector<std::pair<std::uint64_t, std::uintmax_t>> all(pairs.begin(), pairs.end());
+        std::nth_element(all.begin(), all.begin() + static_cast<std::ptrdiff_t>(count), all.end(),
+                [](auto const& a, auto const& b) {
+                    return a.second > b.second;
+                });
+        pairs = {all.begin(), all.begin() + static_cast<std::ptrdiff_t>(count)};
+    };
+    auto scale = std::uintmax_t(1) << sample_shift.load();
+    // (shared bytes, set) for the sets too large to pair up, whose rows list all their contents.
+    std::vector<std::pair<std::uintmax_t, std::uint32_t>> groups;
+    for (std::size_t set = 0; set < sets.size(); ++set) {
+        auto& contents = sets[set].contents;
+        if (contents.size() > max_paired_contents) {
+            if (set_bytes[set] * scale >= options.min_shared_bytes) {
+                groups.emplace_back(set_bytes[set] * scale, static_cast<std::uint32_t>(set));
+            }
+            continue;
+        }
+        for (size_t i = 0; i < contents.size(); ++i) {
+            for (size_t j = i + 1; j < contents.size(); ++j) {
+                pairs[(std::uint64_t(contents[i]) << 32u) | contents[j]] += set_bytes[set];
+            }
+        }
+        if (pairs.size() > max_pairs) {
+            keep_largest(max_pairs / 2);
+        }
+    }
+
+    // Pairs are kept as (shared bytes, contents); groups get the bit no pair of 32-bit
+    // content numbers below single_content can have.
+    constexpr auto group_row = std::uint64_t(1) << 63u;
+    std::vector<std::pair<std::uintmax_t, std::uint64_t>> rows;
+    for (auto& [key, bytes] : pairs) {
+        if (bytes * scale >= options.min_shared_bytes) {
+            rows.emplace_back(bytes * scale, key);
+        }
+    }
+    pairs = {};
+    for (auto& [bytes, set] : groups) {
+        rows.emplace_back(bytes, group_row | set);
+    }
+    groups = {};
+    std::sort(rows.begin(), rows.end(), [](auto const& a, auto const& b) {
+        return a.first > b.first;
+    });
+
+    std::vector<shared_chunks> result;
+    auto budget = options.memory_limit / 4;
+    for (auto& [bytes, key] : rows) {
+        std::vector<fs::path> files;
+        if (key & group_row) {
+            for (auto content : sets[key & ~group_row].contents) {
+                files.emplace_back(paths[content]);
+            }
+        } else {
+            files = {paths[key >> 32u], paths[key & 0xffffffffu]};
+        }
+        // The result's array may be twice the size of its rows.
+        auto cost = 2 * sizeof(shared_chunks) + heap_bytes(files.size() * sizeof(fs::path));
+        for (auto& file : files) {
+            cost += path_bytes(file);
+        }
+        if (cost > budget) {
+            break;
+        }
+        budget -= cost;
+        result.push_back({std::move(files), bytes});
+    }
+    return result;
+}
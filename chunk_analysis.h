@@ -0,0 +1,251 @@
+#ifndef CHUNK_ANALYSIS_H
+#define CHUNK_ANALYSIS_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "file_digest.h"
+
+// FastCDC content-defined chunker with normalized chunking. Boundaries depend only on the
+// bytes around them, so an insertion shifts at most a couple of chunks of a file.
+//
+// The gear value is carried across chunks; it only depends on the last 64 bytes anyway. A
+// buffer is first scanned for candidate cut points, and the min/average/max size rules are
+// then applied to those few candidates rather than to every byte.
+class content_defined_chunker {
+public:
+    static constexpr std::size_t min_size = 2 * 1024;
+    static constexpr std::size_t average_size = 8 * 1024;
+    static constexpr std::size_t max_size = 64 * 1024;
+
+    // Feeds the next piece of the file, calling on_chunk(fingerprint, length) for every chunk it completes.
+    template<typename F>
+    void update(char const* data, std::size_t size, F&& on_chunk)
+    {
+        auto bytes = reinterpret_cast<unsigned char const*>(data);
+        candidates.clear();
+        gear = mark_candidates(bytes, size, gear, candidates);
+        // Positions are counted from the start of the file, `hashed` from the start of the buffer.
+        std::size_t hashed = 0;
+        auto cut = [&](std::uint64_t end) {
+            auto length = end - chunk_start;
+            hasher.update(bytes + hashed, end - offset - hashed);
+            hashed = end - offset;
+            on_chunk(hasher.finish(), length);
+            hasher = {};
+            chunk_start = end;
+        };
+        for (auto candidate : candidates) {
+            auto position = offset + (candidate >> 2u);
+            while (position >= chunk_start + max_size) {
+                cut(chunk_start + max_size);
+            }
+            auto length = position + 1 - chunk_start;
+            auto needed = length < average_size ? cut_small : cut_large;
+            if (length > min_size && (length == max_size || (candidate & needed))) {
+                cut(position + 1);
+            }
+        }
+        while (offset + size >= chunk_start + max_size) {
+            cut(chunk_start + max_size);
+        }
+        hasher.update(bytes + hashed, size - hashed);
+        offset += size;
+    }
+
+    template<typename F>
+    void finish(F&& on_chunk)
+    {
+        if (offset > chunk_start) {
+            on_chunk(hasher.finish(), offset - chunk_start);
+        }
+        hasher = {};
+        gear = 0;
+        offset = 0;
+        chunk_start = 0;
+    }
+
+private:
+    // 15 and 11 one-bits: harder to cut before the average size, easier after it.
+    static constexpr std::uint64_t mask_small = 0x0003590703530000ull;
+    static constexpr std::uint64_t mask_large = 0x0000d90003530000ull;
+
+    static constexpr std::uint8_t cut_small = 1u << 0u;
+    static constexpr std::uint8_t cut_large = 1u << 1u;
+
+    // Four-lane multiply-rotate hash over 32-byte stripes with a final avalanche, so that
+    // every bit of the fingerprint depends on every byte of the chunk.
+    class chunk_hasher {
+    public:
+        void update(unsigned char const* data, std::size_t size)
+        {
+            total += size;
+            if (pending_size > 0) {
+                auto take = std::min(stripe_size - pending_size, size);
+                std::memcpy(pending.data() + pending_size, data, take);
+                pending_size += take;
+                data += take;
+                size -= take;
+                if (pending_size < stripe_size) {
+                    return;
+                }
+                absorb(pending.data());
+                pending_size = 0;
+            }
+            for (; size >= stripe_size; data += stripe_size, size -= stripe_size) {
+                absorb(data);
+            }
+            std::memcpy(pending.data(), data, size);
+            pending_size = size;
+        }
+
+        std::uint64_t finish() const;
+
+    private:
+        static constexpr std::size_t stripe_size = 32;
+
+        std::array<std::uint64_t, 4> lanes = {0x60ea27eeadc0b5d6ull, 0xc2b2ae3d27d4eb4full,
+                                              0x0ull, 0x61c8864e7a143579ull};
+        std::array<unsigned char, stripe_size> pending{};
+        std::size_t pending_size = 0;
+        std::uint64_t total = 0;
+
+        void absorb(unsigned char const* stripe)
+        {
+            for (std::size_t j = 0; j < lanes.size(); ++j) {
+                std::uint64_t word;
+                std::memcpy(&word, stripe + 8 * j, sizeof(word));
+                lanes[j] = round(lanes[j], word);
+            }
+        }
+
+        static std::uint64_t round(std::uint64_t lane, std::uint64_t word)
+        {
+            lane += word * 0xc2b2ae3d27d4eb4full;
+            lane = (lane << 31u) | (lane >> 33u);
+            return lane * 0x9e3779b185ebca87ull;
+        }
+    };
+
+    static std::array<std::uint64_t, 256> const gear_table;
+
+    // Appends `position << 2 | flags` for every position of the buffer whose gear value
+    // satisfies either mask and returns the gear value after the last byte.
+    static std::uint64_t mark_candidates(unsigned char const* data, std::size_t size, std::uint64_t gear,
+            std::vector<std::uint64_t>& candidates);
+
+    std::uint64_t gear = 0;
+    std::uint64_t offset = 0;
+    std::uint64_t chunk_start = 0;
+    chunk_hasher hasher;
+    std::vector<std::uint64_t> candidates;
+};
+
+struct chunk_analysis_options {
+    // Upper bound on the chunk index and the files it refers to, on the chunks collected for
+    // the files being read, and on the results accumulated by report(); beyond it the sample
+    // rate halves.
+    std::size_t memory_limit = 256u << 20u;
+    // Files sharing fewer (estimated) bytes are not reported.
+    std::uintmax_t min_shared_bytes = 1u << 20u;
+};
+
+// Files that are not byte-identical but share content: a pair, or all the files sharing chunks
+// found in too many files to pair them up. Identical copies are represented by one of them.
+struct shared_chunks {
+    std::vector<std::filesystem::path> files;
+    std::uintmax_t shared_bytes;
+};
+
+// Sampled index of chunk fingerprints across distinct file contents. Only chunks whose
+// fingerprint falls into the current sample are kept, so shared bytes are estimated by
+// scaling with the sample rate. add_file may be called from several threads.
+class chunk_analysis {
+public:
+    struct chunk {
+        std::uint64_t fingerprint;
+        std::uint32_t length;
+    };
+
+    // Sampled chunks of a file as it is read. When they fill the file's share of the memory
+    // limit, the sample is narrowed for this file, and add_file narrows the index to match.
+    class file_chunks {
+    public:
+        explicit file_chunks(chunk_analysis const& analysis);
+
+        void add(std::uint64_t fingerprint, std::size_t length);
+
+    private:
+        friend class chunk_analysis;
+
+        chunk_analysis const& analysis;
+        std::size_t capacity;
+        unsigned shift = 0;
+        std::vector<chunk> chunks;
+    };
+
+    explicit chunk_analysis(chunk_analysis_options options = {});
+
+    void add_file(std::filesystem::path const& path, sha256_digest const& hash, file_chunks chunks);
+
+    // Pairs and groups of files, ordered by shared bytes, largest first.
+    std::vector<shared_chunks> report() const;
+
+private:
+    // Chunks in more distinct contents than this (zero pages, the common head of appended
+    // logs) are reported as one group of files, as pairing them up would be quadratic.
+    static constexpr std::size_t max_paired_contents = 16;
+
+    // Set ids with this bit set stand for the single content in their other bits.
+    static constexpr std::uint32_t single_content = 1u << 31u;
+
+    struct entry {
+        std::uint32_t length;
+        std::uint32_t set;
+    };
+
+    // Distinct contents containing a chunk, in increasing order. Chunks found in the same
+    // contents share one set, which is freed with the last of them.
+    struct content_set {
+        std::vector<std::uint32_t> contents;
+        std::uint32_t refs;
+    };
+
+    struct digest_hash {
+        std::size_t operator()(sha256_digest const& digest) const;
+    };
+
+    chunk_analysis_options options;
+    std::atomic<unsigned> sample_shift{0};
+    mutable std::mutex mtx;
+    std::unordered_map<std::uint64_t, entry> index;
+    std::vector<content_set> sets;
+    std::vector<std::uint32_t> free_sets;
+    std::unordered_map<sha256_digest, std::uint32_t, digest_hash> content_ids;
+    // Path of the first file seen with each content.
+    std::vector<std::string> paths;
+    // Heap blocks of the nodes, paths and set contents above.
+    std::size_t node_bytes = 0;
+
+    static bool sampled(std::uint64_t fingerprint, unsigned shift);
+
+    std::size_t used() const;
+
+    std::uint32_t new_set(std::uint32_t set, std::uint32_t content);
+
+    void release(std::uint32_t set);
+
+    void narrow(unsigned shift);
+
+    void shrink();
+};
+
+#endif // CHUNK_ANALYSIS_H
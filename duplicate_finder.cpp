@@ -4,18 +4,55 @@
 
 namespace fs = std::filesystem;
 
-duplicate_finder::duplicate_finder(fs::path path, std::optional<std::regex> filter)
+duplicate_finder::duplicate_finder(fs::path path, std::optional<std::regex> filter,
+        std::optional<external_memory_options> external_memory, bool analyse_chunks)
         :path(std::move(path)),
-         filter(std::move(filter)) { }
+         filter(std::move(filter)),
+         external_memory(std::move(external_memory)),
+         analyse_chunks(analyse_chunks) { }
 
 duplicate_finder::~duplicate_finder() = default;
 
 void duplicate_finder::process()
 {
     try {
-        auto duplicates = find_duplicates(path, filter,
-                [&](int max) {emit_update_bar_max(max);}, [&](int progress) {emit_update_bar_progress(progress); });
-        emit finished(duplicates);
+        // With a memory limit, the analysis gets a quarter of it and the scan the rest.
+        chunk_analysis_options analysis_options;
+        auto scan_memory = external_memory;
+        if (scan_memory.has_value() && analyse_chunks) {
+            analysis_options.memory_limit = scan_memory->memory_limit / 4;
+            scan_memory->memory_limit -= analysis_options.memory_limit;
+        }
+        chunk_analysis analysis(analysis_options);
+        std::vector<std::vector<fs::path>> duplicates;
+        std::shared_ptr<group_store> stored;
+        duplicate_sink on_duplicate = [&duplicates](fs::path const& file, bool new_group) {
+            if (new_group) {
+                duplicates.emplace_back();
+            }
+            duplicates.back().push_back(file);
+        };
+        if (scan_memory.has_value()) {
+            stored = std::make_shared<group_store>(scan_memory->spill_dir);
+            on_duplicate = [&stored](fs::path const& file, bool new_group) {
+                stored->add(file, new_group);
+            };
+        }
+        auto completed = find_duplicates(path, filter,
+                [&](int max) {emit_update_bar_max(max);}, [&](int progress) {emit_update_bar_progress(progress); },
+                on_duplicate, scan_memory, analyse_chunks ? &analysis : nullptr);
+        // A cancelled scan has only seen part of the files.
+        if (analyse_chunks && completed) {
+            emit partial_duplicates_found(analysis.report());
+        }
+        if (stored && completed) {
+            emit finished_on_disk(stored);
+        } else {
+            if (!completed) {
+                duplicates.clear();
+            }
+            emit finished(duplicates);
+        }
     } catch (std::exception& ex) {
         emit error(ex.what());
     }
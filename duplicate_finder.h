@@ -8,19 +8,26 @@
 
 #include <boost/thread.hpp>
 
+#include "find_duplicates.h"
+#include "external_storage.h"
+
 class duplicate_finder : public QObject
 {
     Q_OBJECT
 
 public:
-    duplicate_finder(std::filesystem::path path, std::optional<std::regex> filter);
+    duplicate_finder(std::filesystem::path path, std::optional<std::regex> filter,
+            std::optional<external_memory_options> external_memory, bool analyse_chunks);
     ~duplicate_finder() override;
 
 public slots:
     void process();
 
 signals:
+    void partial_duplicates_found(std::vector<shared_chunks> partial_duplicates);
     void finished(std::vector<std::vector<std::filesystem::path>> duplicates);
+    // Instead of finished() when the scan was limited in memory.
+    void finished_on_disk(std::shared_ptr<group_store> duplicates);
     void error(QString err);
     void update_bar_max(int max);
     void update_bar_progress(int progress);
@@ -28,6 +35,8 @@ signals:
 private:
     std::filesystem::path path;
     std::optional<std::regex> filter;
+    std::optional<external_memory_options> external_memory;
+    bool analyse_chunks;
     void emit_update_bar_max(int max);
     void emit_update_bar_progress(int progress);
 };
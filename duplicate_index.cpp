@@ -0,0 +1,168 @@
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "shard_index.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+    int usage()
+    {
+        std::cerr << "usage: duplicate_index scan [--shard I/N] [--depth D] [--filter REGEX] -o INDEX [LABEL=]ROOT...\n"
+                     "       duplicate_index merge [--requests] [--root LABEL=PATH]... INDEX...\n"
+                     "       duplicate_index fill [--root LABEL=PATH]... INDEX\n";
+        return 2;
+    }
+
+    // Returned by `merge --requests` while some shard still has to run `fill`.
+    constexpr int digests_requested = 3;
+
+    fs::path requests_file(fs::path const& index)
+    {
+        auto file = index;
+        return file += ".requests";
+    }
+
+    // Takes `--root LABEL=PATH` options out of `args`; false if one is malformed.
+    bool take_locations(std::vector<std::string>& args, root_locations& locations)
+    {
+        for (auto it = args.begin(); it != args.end();) {
+            if (*it != "--root") {
+                ++it;
+                continue;
+            }
+            if (std::next(it) == args.end() || std::next(it)->find('=') == std::string::npos) {
+                return false;
+            }
+            auto root = parse_root(*std::next(it));
+            locations[root.label] = root.path;
+            it = args.erase(it, std::next(it, 2));
+        }
+        return true;
+    }
+
+    int scan(std::vector<std::string> const& args)
+    {
+        shard_spec shard{0, 1};
+        std::optional<std::regex> filter;
+        std::optional<fs::path> output;
+        std::vector<index_root> roots;
+        for (size_t i = 0; i < args.size(); ++i) {
+            if (args[i] == "--shard" && i + 1 < args.size()) {
+                auto spec = args[++i];
+                auto slash = spec.find('/');
+                if (slash == std::string::npos) {
+                    return usage();
+                }
+                shard = {static_cast<unsigned>(std::stoul(spec.substr(0, slash))),
+                         static_cast<unsigned>(std::stoul(spec.substr(slash + 1)))};
+            } else if (args[i] == "--depth" && i + 1 < args.size()) {
+                shard.depth = static_cast<unsigned>(std::stoul(args[++i]));
+            } else if (args[i] == "--filter" && i + 1 < args.size()) {
+                filter = std::regex(args[++i]);
+            } else if (args[i] == "-o" && i + 1 < args.size()) {
+                output = args[++i];
+            } else {
+                roots.push_back(parse_root(args[i]));
+            }
+        }
+        if (!output || roots.empty()) {
+            return usage();
+        }
+        write_index(*output, scan_shard(roots, filter, shard));
+        return 0;
+    }
+
+    int merge(std::vector<std::string> args)
+    {
+        root_locations locations;
+        if (!take_locations(args, locations)) {
+            return usage();
+        }
+        bool request = !args.empty() && args.front() == "--requests";
+        if (request) {
+            args.erase(args.begin());
+        }
+        if (args.empty()) {
+            return usage();
+        }
+        std::vector<shard_index> shards;
+        for (auto& file : args) {
+            shards.push_back(read_index(file));
+        }
+        if (request) {
+            auto requests = missing_digests(shards);
+            bool missing = false;
+            for (size_t i = 0; i < args.size(); ++i) {
+                if (!requests[i].empty()) {
+                    write_requests(requests_file(args[i]), requests[i]);
+                    missing = true;
+                }
+            }
+            if (missing) {
+                return digests_requested;
+            }
+        }
+        for (auto& group : merge_indices(std::move(shards), locations)) {
+            for (auto& path : group) {
+                std::cout << path.string() << '\n';
+            }
+            std::cout << '\n';
+        }
+        return 0;
+    }
+
+    int fill(std::vector<std::string> args)
+    {
+        root_locations locations;
+        if (!take_locations(args, locations) || args.size() != 1) {
+            return usage();
+        }
+        fs::path file = args.front();
+        auto index = read_index(file);
+        fill_digests(index, read_requests(requests_file(file)), locations);
+        write_index(file, index);
+        fs::remove(requests_file(file));
+        return 0;
+    }
+
+}
+
+// Scans one shard of a namespace into an index file, or merges shard indices into duplicate
+// groups. Shards are independent processes, possibly on different hosts sharing a mount:
+//     duplicate_index scan --shard 0/2 -o a.idx /data & duplicate_index scan --shard 1/2 -o b.idx /data
+//     duplicate_index merge a.idx b.idx
+// merge hashes whatever the shards left out itself. With --requests it instead writes
+// INDEX.requests for the shards that have to add digests and exits with 3; once each of
+// them has run `fill INDEX` on its own host, merge is run again.
+// Paths are stored relative to their root, which is labelled with its directory name unless
+// given as LABEL=ROOT; shards scanning the same namespace must use the same labels. A host
+// that mounts a root elsewhere than the scanning host passes `--root LABEL=PATH` to fill or
+// merge. Without it, merge can only hash what it finds at the scanning host's paths, so use
+// --requests and let each shard fill on its own host instead.
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        return usage();
+    }
+    std::string command = argv[1];
+    std::vector<std::string> args(argv + 2, argv + argc);
+    try {
+        if (command == "scan") {
+            return scan(args);
+        }
+        if (command == "merge") {
+            return merge(args);
+        }
+        if (command == "fill") {
+            return fill(args);
+        }
+    } catch (std::exception& ex) {
+        std::cerr << ex.what() << '\n';
+        return 1;
+    }
+    return usage();
+}
@@ -0,0 +1,151 @@
+#include "external_storage.h"
+
+#include <random>
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+spill_directory::spill_directory(fs::path const& base)
+{
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    for (int attempt = 0; attempt < 16; ++attempt) {
+        std::ostringstream name;
+        name << "duplicate_finder-" << std::hex << gen();
+        if (fs::create_directories(base / name.str())) {
+            dir = base / name.str();
+            return;
+        }
+    }
+    throw std::runtime_error("Could not create spill directory in \"" + base.string() + "\"");
+}
+
+spill_directory::~spill_directory()
+{
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+}
+
+fs::path const& spill_directory::path() const
+{
+    return dir;
+}
+
+path_store::path_store(fs::path file)
+        :file(std::move(file)),
+         stream(this->file, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc)
+{
+    if (!stream) {
+        throw std::runtime_error("Could not create spill file \"" + this->file.string() + "\"");
+    }
+}
+
+std::uint64_t path_store::add(fs::path const& path)
+{
+    auto const& native = path.native();
+    auto length = static_cast<std::uint32_t>(native.size());
+    auto id = end;
+    // Seeking flushes the stream, so only seek back after a get() has moved it.
+    if (moved) {
+        stream.seekp(static_cast<std::streamoff>(end));
+        moved = false;
+    }
+    stream.write(reinterpret_cast<char const*>(&length), sizeof(length));
+    stream.write(reinterpret_cast<char const*>(native.data()),
+            static_cast<std::streamsize>(length * sizeof(fs::path::value_type)));
+    if (!stream) {
+        throw std::runtime_error("Could not write spill file \"" + file.string() + "\"");
+    }
+    end += sizeof(length) + length * sizeof(fs::path::value_type);
+    return id;
+}
+
+fs::path path_store::get(std::uint64_t id)
+{
+    std::uint32_t length = 0;
+    moved = true;
+    stream.seekg(static_cast<std::streamoff>(id));
+    stream.read(reinterpret_cast<char*>(&length), sizeof(length));
+    fs::path::string_type native(length, fs::path::value_type());
+    stream.read(reinterpret_cast<char*>(native.data()),
+            static_cast<std::streamsize>(length * sizeof(fs::path::value_type)));
+    if (!stream) {
+        throw std::runtime_error("Could not read spill file \"" + file.string() + "\"");
+    }
+    return fs::path(std::move(native));
+}
+
+group_store::id_table::id_table(fs::path file)
+        :file(std::move(file)),
+         stream(this->file, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc)
+{
+    if (!stream) {
+        throw std::runtime_error("Could not create spill file \"" + this->file.string() + "\"");
+    }
+}
+
+void group_store::id_table::push(std::uint64_t value)
+{
+    if (moved) {
+        stream.seekp(static_cast<std::streamoff>(count * sizeof(value)));
+        moved = false;
+    }
+    stream.write(reinterpret_cast<char const*>(&value), sizeof(value));
+    if (!stream) {
+        throw std::runtime_error("Could not write spill file \"" + file.string() + "\"");
+    }
+    ++count;
+}
+
+std::uint64_t group_store::id_table::at(std::uint64_t index)
+{
+    std::uint64_t value = 0;
+    moved = true;
+    stream.seekg(static_cast<std::streamoff>(index * sizeof(value)));
+    stream.read(reinterpret_cast<char*>(&value), sizeof(value));
+    if (!stream) {
+        throw std::runtime_error("Could not read spill file \"" + file.string() + "\"");
+    }
+    return value;
+}
+
+std::uint64_t group_store::id_table::size() const
+{
+    return count;
+}
+
+group_store::group_store(fs::path const& base)
+        :dir(base),
+         paths(dir.path() / "paths"),
+         ids(dir.path() / "ids"),
+         starts(dir.path() / "starts") { }
+
+void group_store::add(fs::path const& file, bool new_group)
+{
+    if (new_group || starts.size() == 0) {
+        starts.push(ids.size());
+    }
+    ids.push(paths.add(file));
+}
+
+std::uint64_t group_store::group_count() const
+{
+    return starts.size();
+}
+
+std::uint64_t group_store::group_size(std::uint64_t group)
+{
+    auto end = group + 1 < starts.size() ? starts.at(group + 1) : ids.size();
+    return end - starts.at(group);
+}
+
+std::vector<fs::path> group_store::files(std::uint64_t group, std::uint64_t from, std::uint64_t count)
+{
+    auto size = group_size(group);
+    auto first = starts.at(group);
+    std::vector<fs::path> result;
+    for (auto i = from; i < size && i < from + count; ++i) {
+        result.push_back(paths.get(ids.at(first + i)));
+    }
+    return result;
+}
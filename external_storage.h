@@ -0,0 +1,288 @@
+#ifndef EXTERNAL_STORAGE_H
+#define EXTERNAL_STORAGE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Scratch directory for spill files, removed together with its contents on destruction.
+class spill_directory {
+public:
+    explicit spill_directory(std::filesystem::path const& base);
+    ~spill_directory();
+
+    spill_directory(spill_directory const&) = delete;
+    spill_directory& operator=(spill_directory const&) = delete;
+
+    std::filesystem::path const& path() const;
+
+private:
+    std::filesystem::path dir;
+};
+
+// Append-only on-disk path table, so that records can refer to paths by a fixed-size id.
+class path_store {
+public:
+    explicit path_store(std::filesystem::path file);
+
+    std::uint64_t add(std::filesystem::path const& path);
+    std::filesystem::path get(std::uint64_t id);
+
+private:
+    std::filesystem::path file;
+    std::fstream stream;
+    std::uint64_t end = 0;
+    bool moved = false;
+};
+
+// Duplicate groups written to disk as they are found, so that a large result does not count
+// against the memory limit. Files are appended one at a time and read back a page at a time.
+class group_store {
+public:
+    explicit group_store(std::filesystem::path const& base);
+
+    // Appends a file to the last group, or to a new one if new_group is set.
+    void add(std::filesystem::path const& file, bool new_group);
+
+    std::uint64_t group_count() const;
+    std::uint64_t group_size(std::uint64_t group);
+
+    // Up to `count` files of the group, starting with its `from`th.
+    std::vector<std::filesystem::path> files(std::uint64_t group, std::uint64_t from, std::uint64_t count);
+
+private:
+    // Append-only table of integers on disk.
+    class id_table {
+    public:
+        explicit id_table(std::filesystem::path file);
+
+        void push(std::uint64_t value);
+        std::uint64_t at(std::uint64_t index);
+        std::uint64_t size() const;
+
+    private:
+        std::filesystem::path file;
+        std::fstream stream;
+        std::uint64_t count = 0;
+        bool moved = false;
+    };
+
+    spill_directory dir;
+    path_store paths;
+    // Path id of every file, group after group, and the index of the first file of every group.
+    id_table ids;
+    id_table starts;
+};
+
+// Sorts trivially copyable records that may not fit in memory: records are buffered up to
+// the memory limit, spilled to sorted run files and k-way merged when read back.
+template<typename Record>
+class external_sorter {
+    static_assert(std::is_trivially_copyable_v<Record>, "Records are stored as raw bytes");
+
+public:
+    external_sorter(std::filesystem::path dir, std::size_t memory_limit)
+            :dir(std::move(dir)),
+             memory_limit(memory_limit),
+             capacity(std::max<std::size_t>(memory_limit / sizeof(Record), 1))
+    {
+        std::filesystem::create_directories(this->dir);
+    }
+
+    void push(Record const& record)
+    {
+        if (buffer.capacity() < capacity) {
+            // Reserved on first use rather than grown geometrically, which could overshoot the limit.
+            buffer.reserve(capacity);
+        }
+        if (buffer.size() >= capacity) {
+            spill();
+        }
+        buffer.push_back(record);
+    }
+
+    // Visits every pushed record in ascending order and leaves the sorter empty.
+    template<typename F>
+    void merge(F&& visit)
+    {
+        if (runs.empty()) {
+            std::sort(buffer.begin(), buffer.end());
+            for (auto& record : buffer) {
+                visit(record);
+            }
+            buffer = {};
+            return;
+        }
+        spill();
+        buffer = {};
+
+        // The sorted buffer is released by now; half of the budget is enough for the run readers.
+        auto fan_in = std::max<std::size_t>(memory_limit / 2 / run_buffer_bytes, 2);
+        while (runs.size() > fan_in) {
+            std::vector<std::filesystem::path> group(runs.begin(), runs.begin() + fan_in);
+            runs.erase(runs.begin(), runs.begin() + fan_in);
+            run_writer writer(next_run());
+            merge_runs(group, [&](Record const& record) {
+                writer.write(record);
+            });
+            runs.push_back(writer.finish());
+        }
+        std::vector<std::filesystem::path> last(runs.begin(), runs.end());
+        runs.clear();
+        merge_runs(last, visit);
+    }
+
+private:
+    static constexpr std::size_t run_buffer_bytes = 64 * 1024;
+    static constexpr std::size_t run_buffer_records = std::max<std::size_t>(run_buffer_bytes / sizeof(Record), 1);
+
+    class run_writer {
+    public:
+        explicit run_writer(std::filesystem::path file)
+                :file(std::move(file)),
+                 fout(this->file, std::ios::binary | std::ios::trunc)
+        {
+            if (!fout) {
+                throw std::runtime_error("Could not create spill file \"" + this->file.string() + "\"");
+            }
+            chunk.reserve(run_buffer_records);
+        }
+
+        void write(Record const& record)
+        {
+            chunk.push_back(record);
+            if (chunk.size() == run_buffer_records) {
+                flush();
+            }
+        }
+
+        std::filesystem::path finish()
+        {
+            flush();
+            fout.close();
+            if (!fout) {
+                throw std::runtime_error("Could not write spill file \"" + file.string() + "\"");
+            }
+            return file;
+        }
+
+    private:
+        std::filesystem::path file;
+        std::ofstream fout;
+        std::vector<Record> chunk;
+
+        void flush()
+        {
+            fout.write(reinterpret_cast<char const*>(chunk.data()),
+                    static_cast<std::streamsize>(chunk.size() * sizeof(Record)));
+            chunk.clear();
+        }
+    };
+
+    class run_reader {
+    public:
+        explicit run_reader(std::filesystem::path file)
+                :file(std::move(file)),
+                 fin(this->file, std::ios::binary),
+                 chunk(run_buffer_records)
+        {
+            if (!fin) {
+                throw std::runtime_error("Could not open spill file \"" + this->file.string() + "\"");
+            }
+        }
+
+        ~run_reader()
+        {
+            fin.close();
+            std::error_code ec;
+            std::filesystem::remove(file, ec);
+        }
+
+        bool next()
+        {
+            if (++position < count) {
+                return true;
+            }
+            fin.read(reinterpret_cast<char*>(chunk.data()),
+                    static_cast<std::streamsize>(chunk.size() * sizeof(Record)));
+            count = static_cast<std::size_t>(fin.gcount()) / sizeof(Record);
+            position = 0;
+            return count > 0;
+        }
+
+        Record const& current() const
+        {
+            return chunk[position];
+        }
+
+    private:
+        std::filesystem::path file;
+        std::ifstream fin;
+        std::vector<Record> chunk;
+        std::size_t position = 0;
+        std::size_t count = 0;
+    };
+
+    std::filesystem::path dir;
+    std::size_t memory_limit;
+    std::size_t capacity;
+    std::vector<Record> buffer;
+    std::deque<std::filesystem::path> runs;
+    std::size_t run_counter = 0;
+
+    std::filesystem::path next_run()
+    {
+        return dir / ("run-" + std::to_string(run_counter++));
+    }
+
+    void spill()
+    {
+        if (buffer.empty()) {
+            return;
+        }
+        std::sort(buffer.begin(), buffer.end());
+        run_writer writer(next_run());
+        for (auto& record : buffer) {
+            writer.write(record);
+        }
+        runs.push_back(writer.finish());
+        buffer.clear();
+    }
+
+    template<typename F>
+    static void merge_runs(std::vector<std::filesystem::path> const& files, F&& visit)
+    {
+        std::vector<std::unique_ptr<run_reader>> readers;
+        for (auto& file : files) {
+            readers.push_back(std::make_unique<run_reader>(file));
+        }
+        auto greater = [&readers](std::size_t a, std::size_t b) {
+            return readers[b]->current() < readers[a]->current();
+        };
+        std::priority_queue<std::size_t, std::vector<std::size_t>, decltype(greater)> heap(greater);
+        for (std::size_t i = 0; i < readers.size(); ++i) {
+            if (readers[i]->next()) {
+                heap.push(i);
+            }
+        }
+        while (!heap.empty()) {
+            auto i = heap.top();
+            heap.pop();
+            visit(readers[i]->current());
+            if (readers[i]->next()) {
+                heap.push(i);
+            }
+        }
+    }
+};
+
+#endif // EXTERNAL_STORAGE_H
@@ -0,0 +1,53 @@
+#include "file_digest.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+#include <QtCore>
+
+#ifdef Q_OS_UNIX
+#include <sys/stat.h>
+#endif
+
+namespace fs = std::filesystem;
+
+sha256_digest sha256(fs::path const& path, std::uintmax_t limit,
+        std::function<void(char const*, std::size_t)> const& on_data)
+{
+    std::array<char, 8192> buffer{};
+    std::ifstream fin(path, std::ios::binary);
+    if (!fin) {
+        throw std::runtime_error("Could not get hash of \"" + path.string() + "\"");
+    }
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    std::uintmax_t left = limit;
+    while (left > 0) {
+        fin.read(buffer.data(), static_cast<std::streamsize>(std::min<std::uintmax_t>(buffer.size(), left)));
+        auto gcount = static_cast<int>(fin.gcount());
+        if (gcount == 0) {
+            break;
+        }
+        hash.addData(buffer.data(), gcount);
+        if (on_data) {
+            on_data(buffer.data(), static_cast<std::size_t>(gcount));
+        }
+        left -= static_cast<std::uintmax_t>(gcount);
+    }
+    auto result = hash.result();
+    sha256_digest digest{};
+    std::copy_n(result.constData(), std::min<std::size_t>(static_cast<std::size_t>(result.size()), digest.size()),
+            digest.begin());
+    return digest;
+}
+
+std::pair<std::uint64_t, std::uint64_t> file_identity(fs::path const& path)
+{
+#ifdef Q_OS_UNIX
+    struct stat st{};
+    if (::stat(path.c_str(), &st) == 0) {
+        return {static_cast<std::uint64_t>(st.st_dev), static_cast<std::uint64_t>(st.st_ino)};
+    }
+#endif
+    return {0, 0};
+}
@@ -0,0 +1,22 @@
+#ifndef FILE_DIGEST_H
+#define FILE_DIGEST_H
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <limits>
+#include <utility>
+
+using sha256_digest = std::array<char, 32>;
+
+// SHA-256 of the first `limit` bytes of the file. Every buffer read is also passed to on_data,
+// so that callers can do more work in the same pass (or throw to abandon it).
+sha256_digest sha256(std::filesystem::path const& path,
+        std::uintmax_t limit = std::numeric_limits<std::uintmax_t>::max(),
+        std::function<void(char const*, std::size_t)> const& on_data = {});
+
+// (device, inode) of the file, or zeros where the platform does not expose them.
+std::pair<std::uint64_t, std::uint64_t> file_identity(std::filesystem::path const& path);
+
+#endif // FILE_DIGEST_H
@@ -1,6 +1,8 @@
 #include "find_duplicates.h"
 
 #include <map>
+#include <array>
+#include <tuple>
 #include <fstream>
 #include <iomanip>
 #include <string>
@@ -10,11 +12,16 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <algorithm>
+#include <limits>
 
 #include <boost/lockfree/queue.hpp>
 
 #include <QtCore>
 
+#include "external_storage.h"
+#include "file_digest.h"
+#include "chunk_analysis.h"
+
 namespace fs = std::filesystem;
 
 namespace {
@@ -22,17 +29,141 @@ namespace {
     struct cancellation_exception : std::exception {
     };
 
+    using hash_bucket_map = std::map<sha256_digest, std::vector<size_t>>;
+
+    // Every queued index holds a cache-line aligned node in the work queue's freelist.
+    constexpr size_t queue_node_bytes = 64;
+
+    // Every hashed file costs an rb-tree node with its digest in the batch's hash_bucket_map,
+    // plus the heap block of the bucket's index vector.
+    constexpr size_t hash_bucket_bytes = 128;
+
+    struct file_record {
+        uintmax_t size;
+        uint64_t device;
+        uint64_t inode;
+        uint64_t path_id;
+
+        bool operator<(file_record const& other) const {
+            return std::tie(size, device, inode, path_id) < std::tie(other.size, other.device, other.inode, other.path_id);
+        }
+    };
+
+    struct hash_record {
+        uintmax_t size;
+        sha256_digest hash;
+        uint64_t path_id;
+
+        bool operator<(hash_record const& other) const {
+            return std::tie(size, hash, path_id) < std::tie(other.size, other.hash, other.path_id);
+        }
+    };
+
+    void find_duplicates_external(fs::path const& dir, std::optional<std::regex> const& filter,
+            external_memory_options const& options, std::function<void()> const& cancellation_point,
+            std::function<hash_bucket_map(std::vector<fs::path> const&)> const& hash_batch,
+            std::function<void(int)> const& on_progress_max, bool hash_all,
+            duplicate_sink const& on_duplicate)
+    {
+        // Within a size class files are hashed in (device, inode) order, which tends to follow on-disk layout.
+        // Traversal records get half of the budget, the batch being hashed and the hash records
+        // a quarter each, so that the three never add up to more than the limit.
+        spill_directory spill(options.spill_dir);
+        path_store names(spill.path() / "paths");
+        external_sorter<file_record> files(spill.path() / "files", options.memory_limit / 2);
+        external_sorter<hash_record> hashes(spill.path() / "hashes", options.memory_limit / 4);
+
+        int file_count = 0;
+        for (auto& path : fs::recursive_directory_iterator(dir)) {
+            cancellation_point();
+            if (!path.is_regular_file()) {
+                continue;
+            }
+            if (!filter.has_value() || std::regex_match(path.path().string(), *filter)) {
+                auto [device, inode] = file_identity(path.path());
+                files.push({path.file_size(), device, inode, names.add(path.path())});
+                ++file_count;
+            }
+        }
+        on_progress_max(file_count);
+
+        std::vector<fs::path> batch;
+        std::vector<file_record> batch_records;
+        size_t batch_bytes = 0;
+        auto flush = [&]() {
+            if (batch.empty()) {
+                return;
+            }
+            for (auto& bucket : hash_batch(batch)) {
+                for (auto index : bucket.second) {
+                    hashes.push({batch_records[index].size, bucket.first, batch_records[index].path_id});
+                }
+            }
+            batch.clear();
+            batch_records.clear();
+            batch_bytes = 0;
+        };
+        auto add = [&](file_record const& record) {
+            batch.push_back(names.get(record.path_id));
+            batch_records.push_back(record);
+            batch_bytes += sizeof(file_record) + sizeof(fs::path) + queue_node_bytes + hash_bucket_bytes
+                    + batch.back().native().size();
+            if (batch_bytes >= options.memory_limit / 4) {
+                flush();
+            }
+        };
+
+        file_record head{};
+        size_t class_count = 0;
+        files.merge([&](file_record const& record) {
+            cancellation_point();
+            // Batches may span size classes: hash records carry the size, so grouping stays exact.
+            if (class_count == 0 || record.size != head.size) {
+                head = record;
+                class_count = 1;
+                if (hash_all) {
+                    add(record);
+                }
+                return;
+            }
+            if (++class_count == 2 && !hash_all) {
+                add(head);
+            }
+            add(record);
+        });
+        flush();
+
+        // Only the first file of a group is held back, until a second one shows that there is a group at all.
+        hash_record first{};
+        uint64_t group_size = 0;
+        hashes.merge([&](hash_record const& record) {
+            cancellation_point();
+            if (group_size == 0 || record.size != first.size || record.hash != first.hash) {
+                first = record;
+                group_size = 1;
+                return;
+            }
+            if (++group_size == 2) {
+                on_duplicate(names.get(first.path_id), true);
+            }
+            on_duplicate(names.get(record.path_id), false);
+        });
+    }
+
 }
 
-std::vector<std::vector<fs::path>>
-find_duplicates(fs::path const& dir, std::optional<std::regex> const& filter,
-        std::function<void(int)> on_progress_max, std::function<void(int)> on_progress_update)
+bool find_duplicates(fs::path const& dir, std::optional<std::regex> const& filter,
+        std::function<void(int)> on_progress_max, std::function<void(int)> on_progress_update,
+        duplicate_sink const& on_duplicate, std::optional<external_memory_options> const& external_memory,
+        chunk_analysis* analysis)
 {
     const auto thread_count = std::min(std::thread::hardware_concurrency(), 4u);
     std::vector<std::thread> threads;
-    boost::lockfree::queue<fs::path*> paths(4);
-    std::atomic_bool work_given;
-    std::atomic_bool finished;
+    boost::lockfree::queue<size_t> paths(4);
+    size_t paths_reserved = 4;
+    std::vector<fs::path> const* batch = nullptr;
+    std::atomic_bool work_given{false};
+    std::atomic_bool finished{false};
     std::vector<std::atomic_bool> work_done(thread_count);
     std::condition_variable work;
     std::condition_variable done;
@@ -40,52 +171,58 @@ find_duplicates(fs::path const& dir, std::optional<std::regex> const& filter,
     std::mutex wait_mtx;
     std::mutex mtx;
     std::exception_ptr ex_ptr;
-    std::map<std::string, std::vector<fs::path>> hash_buckets;
-    std::vector<std::vector<fs::path>> duplicates;
+    hash_bucket_map hash_buckets;
     try {
         if (!fs::is_directory(dir)) {
             throw std::invalid_argument("Provided path should refer to a directory");
         }
 
-        auto cancellation_point = [thread = QThread::currentThread()]() {
+        std::function<void()> cancellation_point = [thread = QThread::currentThread()]() {
             if (thread->isInterruptionRequested()) {
                 throw cancellation_exception();
             }
         };
 
         auto get_sha256hash = [&](fs::path const& path) {
-            std::array<char, 8192> buffer{};
-            std::ifstream fin(path, std::ios::binary);
-            if (!fin) {
-                throw std::runtime_error("Could not get hash of \"" + path.string() + "\"");
-            }
-            QCryptographicHash hash(QCryptographicHash::Sha256);
-            int gcount = 0;
-            do {
+            content_defined_chunker chunker;
+            std::optional<chunk_analysis::file_chunks> chunks;
+            if (analysis) {
+                chunks.emplace(*analysis);
+            }
+            auto on_chunk = [&](uint64_t fingerprint, size_t length) {
+                chunks->add(fingerprint, length);
+            };
+            cancellation_point();
+            auto result = sha256(path, std::numeric_limits<uintmax_t>::max(), [&](char const* data, size_t size) {
                 cancellation_point();
-                fin.read(buffer.data(), buffer.size());
-                gcount = static_cast<int>(fin.gcount());
-                hash.addData(buffer.data(), gcount);
+                if (analysis) {
+                    chunker.update(data, size, on_chunk);
+                }
+            });
+            if (analysis) {
+                chunker.finish(on_chunk);
+                analysis->add_file(path, result, std::move(*chunks));
             }
-            while (gcount > 0);
-            return hash.result().toStdString();
+            return result;
         };
 
         int file_count = 0;
 
         auto consumer = [&](int i) {
-            while (!finished) {
+            // finished is read under the same lock as the round it belongs to, so that the last round is acknowledged too.
+            bool stop = false;
+            while (!stop) {
                 try {
                     {
                         std::unique_lock<std::mutex> lk(work_wait_mtx);
                         work.wait(lk, [&work_given, &work_done, i] { return work_given == true && !work_done[i]; });
+                        stop = finished;
                     }
-                    fs::path* path_ptr;
-                    while (paths.pop(path_ptr) && !ex_ptr) {
-                        fs::path path = *path_ptr;
-                        auto hash = get_sha256hash(path);
+                    size_t index;
+                    while (paths.pop(index) && !ex_ptr) {
+                        auto hash = get_sha256hash((*batch)[index]);
                         std::lock_guard<std::mutex> lg(mtx);
-                        hash_buckets[hash].emplace_back(std::move(path));
+                        hash_buckets[hash].push_back(index);
                         ++file_count;
                         cancellation_point();
                         on_progress_update(file_count);
@@ -110,65 +247,83 @@ find_duplicates(fs::path const& dir, std::optional<std::regex> const& filter,
             threads.emplace_back(consumer, i);
         }
 
-        std::unordered_map<uintmax_t, std::vector<fs::path>> size_buckets;
-        for (auto& path : fs::recursive_directory_iterator(dir)) {
-            cancellation_point();
-            if (!path.is_regular_file()) {
-                continue;
+        auto hash_batch = [&](std::vector<fs::path> const& files) {
+            hash_buckets.clear();
+            batch = &files;
+            // reserve() grows the freelist by its argument on every call, so only top it up to the largest batch.
+            if (files.size() > paths_reserved) {
+                paths.reserve(files.size() - paths_reserved);
+                paths_reserved = files.size();
             }
-            if (!filter.has_value() || std::regex_match(path.path().string(), *filter)) {
-                size_buckets[path.file_size()].emplace_back(path.path());
-                ++file_count;
+            for (size_t i = 0; i < files.size(); ++i) {
+                paths.push(i);
             }
-        }
-        on_progress_max(file_count);
 
-        file_count = 0;
-        for (auto& size_bucket : size_buckets) {
-            cancellation_point();
-            if (auto count = size_bucket.second.size(); count > 1) {
-                hash_buckets.clear();
-                paths.reserve(count);
-                for (auto& path : size_bucket.second) {
-                    paths.push(&path);
-                }
-
-                {
-                    std::lock_guard<std::mutex> lg(work_wait_mtx);
-                    std::for_each(work_done.begin(), work_done.end(), [](std::atomic_bool& b) {
-                        b = false;
-                    });
-                    work_given = true;
-                    work.notify_all();
-                }
+            {
+                std::lock_guard<std::mutex> lg(work_wait_mtx);
+                std::for_each(work_done.begin(), work_done.end(), [](std::atomic_bool& b) {
+                    b = false;
+                });
+                work_given = true;
+                work.notify_all();
+            }
 
-                std::unique_lock<std::mutex> lk(wait_mtx);
-                done.wait(lk, [&work_done]() {
-                    return std::all_of(work_done.begin(), work_done.end(), [](std::atomic_bool& b) {
-                        return b == true;
-                    });
+            std::unique_lock<std::mutex> lk(wait_mtx);
+            done.wait(lk, [&work_done]() {
+                return std::all_of(work_done.begin(), work_done.end(), [](std::atomic_bool& b) {
+                    return b == true;
                 });
-                work_given = false;
-                if (ex_ptr) {
-                    std::rethrow_exception(ex_ptr);
+            });
+            work_given = false;
+            batch = nullptr;
+            if (ex_ptr) {
+                std::rethrow_exception(ex_ptr);
+            }
+            return std::move(hash_buckets);
+        };
+
+        if (external_memory.has_value()) {
+            find_duplicates_external(dir, filter, *external_memory, cancellation_point, hash_batch,
+                    on_progress_max, analysis != nullptr, on_duplicate);
+        } else {
+            std::unordered_map<uintmax_t, std::vector<fs::path>> size_buckets;
+            for (auto& path : fs::recursive_directory_iterator(dir)) {
+                cancellation_point();
+                if (!path.is_regular_file()) {
+                    continue;
                 }
+                if (!filter.has_value() || std::regex_match(path.path().string(), *filter)) {
+                    size_buckets[path.file_size()].emplace_back(path.path());
+                    ++file_count;
+                }
+            }
+            on_progress_max(file_count);
 
-                for (auto& bucket : hash_buckets) {
-                    cancellation_point();
-                    if (bucket.second.size() > 1) {
-                        std::vector<fs::path> files;
-                        for (auto& file : bucket.second) {
-                            files.push_back(file);
+            file_count = 0;
+            std::vector<fs::path> singles;
+            for (auto& size_bucket : size_buckets) {
+                cancellation_point();
+                if (size_bucket.second.size() == 1 && analysis) {
+                    singles.push_back(std::move(size_bucket.second.front()));
+                } else if (size_bucket.second.size() > 1) {
+                    for (auto& bucket : hash_batch(size_bucket.second)) {
+                        cancellation_point();
+                        if (bucket.second.size() > 1) {
+                            for (auto index : bucket.second) {
+                                on_duplicate(size_bucket.second[index], index == bucket.second.front());
+                            }
                         }
-                        duplicates.push_back(std::move(files));
                     }
                 }
             }
+            // Files of a unique size cannot be exact duplicates; they are only read for the analysis.
+            if (!singles.empty()) {
+                hash_batch(singles);
+            }
         }
         cancellation_point();
     }
     catch (...) {
-        duplicates.clear();
         ex_ptr = std::current_exception();
     }
 
@@ -197,7 +352,26 @@ find_duplicates(fs::path const& dir, std::optional<std::regex> const& filter,
             std::rethrow_exception(ex_ptr);
         }
     } catch (cancellation_exception& ex) {
-        // No operations.
+        return false;
+    }
+    return true;
+}
+
+std::vector<std::vector<fs::path>>
+find_duplicates(fs::path const& dir, std::optional<std::regex> const& filter,
+        std::function<void(int)> on_progress_max, std::function<void(int)> on_progress_update,
+        std::optional<external_memory_options> const& external_memory, chunk_analysis* analysis)
+{
+    std::vector<std::vector<fs::path>> duplicates;
+    auto completed = find_duplicates(dir, filter, std::move(on_progress_max), std::move(on_progress_update),
+            [&duplicates](fs::path const& file, bool new_group) {
+                if (new_group) {
+                    duplicates.emplace_back();
+                }
+                duplicates.back().push_back(file);
+            }, external_memory, analysis);
+    if (!completed) {
+        duplicates.clear();
     }
     return duplicates;
 }
\ No newline at end of file
@@ -2,14 +2,41 @@
 #define FIND_DUPLICATES_H
 
 #include <filesystem>
+#include <functional>
+#include <optional>
 #include <regex>
 #include <vector>
 #include <stdexcept>
 
 #include <QProgressBar>
 
+#include "chunk_analysis.h"
+
+// Out-of-core mode: traversal and hash records are spilled to sorted runs under spill_dir
+// so that peak memory of the scan stays around memory_limit bytes. Groups are passed on as
+// they are found, so results kept in a group_store do not count against it either.
+struct external_memory_options {
+    std::size_t memory_limit;
+    std::filesystem::path spill_dir;
+};
+
+// Receives the groups one file at a time, new_group being set for the first file of each, so
+// that not even a single group has to be held in memory.
+using duplicate_sink = std::function<void(std::filesystem::path const& file, bool new_group)>;
+
+// With analysis set, every file is read once and chunked in the same pass that hashes it,
+// so that analysis can report shared bytes between files that are not exact duplicates.
+// Returns false if the scan was interrupted, in which case on_duplicate has only seen part of the groups.
+bool find_duplicates(std::filesystem::path const& dir, std::optional<std::regex> const& filter,
+        std::function<void(int)> on_progress_max_determination, std::function<void(int)> on_progress_update,
+        duplicate_sink const& on_duplicate,
+        std::optional<external_memory_options> const& external_memory = std::nullopt,
+        chunk_analysis* analysis = nullptr);
+
 std::vector<std::vector<std::filesystem::path>>
 find_duplicates(std::filesystem::path const& dir, std::optional<std::regex> const& filter,
-        std::function<void(int)> on_progress_max_determination, std::function<void(int)> on_progress_update);
+        std::function<void(int)> on_progress_max_determination, std::function<void(int)> on_progress_update,
+        std::optional<external_memory_options> const& external_memory = std::nullopt,
+        chunk_analysis* analysis = nullptr);
 
 #endif // FIND_DUPLICATES_H
@@ -11,6 +11,7 @@
 
 #include <QDir>
 #include <QFileDialog>
+#include <QStandardPaths>
 #include <QTreeWidgetItem>
 #include <QStandardItemModel>
 
@@ -22,6 +23,19 @@
 namespace fs = std::filesystem;
 
 Q_DECLARE_METATYPE(std::vector<std::vector<std::filesystem::path>>);
+Q_DECLARE_METATYPE(std::vector<shared_chunks>);
+Q_DECLARE_METATYPE(std::shared_ptr<group_store>);
+
+namespace {
+
+    // Rows of a scan kept on disk are loaded as they are expanded or asked for.
+    constexpr int page_size = 1000;
+    // Index of the group shown by a group row.
+    constexpr int group_role = Qt::UserRole;
+    // Index of the next group (top level) or file (within a group) of a "more" row.
+    constexpr int more_role = Qt::UserRole + 1;
+
+}
 
 main_window::main_window(QWidget *parent) :
     QMainWindow(parent),
@@ -37,6 +51,10 @@ main_window::main_window(QWidget *parent) :
     ui->currentDir->setPalette(palette);
     ui->currentDir->setText(QDir::currentPath());
     ui->filterRegex->setPalette(palette);
+    ui->spillDir->setPalette(palette);
+    // Spill files belong on disk; the temporary directory is often a tmpfs.
+    auto cache = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    ui->spillDir->setText(cache.isEmpty() ? QDir::tempPath() : cache);
     ui->treeWidget->setPalette(palette);
     ui->treeWidget->setSelectionMode(QAbstractItemView::ExtendedSelection);
     ui->treeWidget->header()->setSectionResizeMode(QHeaderView::ResizeToContents);
@@ -51,10 +69,14 @@ main_window::main_window(QWidget *parent) :
     delete_popup->ui->buttonBox->button(QDialogButtonBox::Cancel)->setDefault(true);
 
     qRegisterMetaType<std::vector<std::vector<std::filesystem::path>>>();
+    qRegisterMetaType<std::vector<shared_chunks>>();
+    qRegisterMetaType<std::shared_ptr<group_store>>();
 
     connect(ui->scanButton, &QPushButton::clicked, this, &main_window::scan);
     connect(ui->filterRegex, &QLineEdit::textEdited, this, &main_window::validate_regex);
     connect(ui->filterFlag, &QCheckBox::stateChanged, this, &main_window::filter_state_changed);
+    connect(ui->memoryLimitFlag, &QCheckBox::stateChanged, this, &main_window::memory_limit_state_changed);
+    connect(ui->changeSpillDirButton, &QPushButton::clicked, this, &main_window::change_spill_dir);
     connect(ui->currentDir, &QLineEdit::textEdited, this, &main_window::validate_dir);
     connect(ui->changeDirButton, &QPushButton::clicked, this, &main_window::change_dir);
     connect(ui->expandAllButton, &QPushButton::clicked, this, &main_window::expand_all);
@@ -62,6 +84,8 @@ main_window::main_window(QWidget *parent) :
     connect(ui->autoselectButton, &QPushButton::clicked, this, &main_window::autoselect);
     connect(ui->deleteButton, &QPushButton::clicked, this, &main_window::delete_selected);
     connect(ui->treeWidget, &QTreeWidget::itemSelectionChanged, this, &main_window::validate_selection);
+    connect(ui->treeWidget, &QTreeWidget::itemExpanded, this, &main_window::load_group);
+    connect(ui->treeWidget, &QTreeWidget::itemActivated, this, &main_window::load_more);
 
     connect(popup->ui->pushButton, &QPushButton::clicked, this, &main_window::request_cancel_scan);
 }
@@ -72,15 +96,24 @@ void main_window::scan()
 {
     scanning_thread = new QThread();
     auto* worker = new duplicate_finder(ui->currentDir->text().toStdString(),
-            ui->filterFlag->checkState() ? std::make_optional(std::regex(ui->filterRegex->text().toStdString())) : std::nullopt);
+            ui->filterFlag->checkState() ? std::make_optional(std::regex(ui->filterRegex->text().toStdString())) : std::nullopt,
+            ui->memoryLimitFlag->checkState() ? std::make_optional(external_memory_options{
+                    static_cast<std::size_t>(ui->memoryLimit->value()) << 20u,
+                    ui->spillDir->text().toStdString()}) : std::nullopt,
+            ui->partialFlag->checkState());
+    partial_duplicates.clear();
     worker->moveToThread(scanning_thread);
     connect(worker, &duplicate_finder::error, this, &main_window::scan_error);
     connect(scanning_thread, &QThread::started, worker, &duplicate_finder::process);
     connect(worker, &duplicate_finder::update_bar_max, this, &main_window::set_bar_max);
     connect(worker, &duplicate_finder::update_bar_progress, this, &main_window::set_bar_progress);
+    connect(worker, &duplicate_finder::partial_duplicates_found, this, &main_window::store_partial_duplicates);
     connect(worker, &duplicate_finder::finished, this, &main_window::finish_scan);
     connect(worker, &duplicate_finder::finished, scanning_thread, &QThread::quit);
     connect(worker, &duplicate_finder::finished, worker, &duplicate_finder::deleteLater);
+    connect(worker, &duplicate_finder::finished_on_disk, this, &main_window::finish_scan_on_disk);
+    connect(worker, &duplicate_finder::finished_on_disk, scanning_thread, &QThread::quit);
+    connect(worker, &duplicate_finder::finished_on_disk, worker, &duplicate_finder::deleteLater);
     connect(scanning_thread, &QThread::finished, scanning_thread, &QThread::deleteLater);
     scanning_thread->start();
     popup->ui->progressBar->setValue(0);
@@ -95,15 +128,11 @@ void main_window::request_cancel_scan() {
 
 void main_window::finish_scan(std::vector<std::vector<std::filesystem::path>> duplicates) {
     popup->close();
+    stored_groups.reset();
     ui->treeWidget->setUpdatesEnabled(false);
     ui->treeWidget->clear();
     for (size_t i = 0; i < duplicates.size(); ++i) {
-        auto* top_item = new QTreeWidgetItem();
-        fs::path& head = duplicates[i][0];
-        top_item->setText(0, QString("Group %1 (%2), files: %3, size of each: %4 bytes").
-        arg(std::to_string(i + 1).c_str(), head.filename().c_str(),
-                std::to_string(duplicates[i].size()).c_str(), std::to_string(fs::file_size(head)).c_str()));
-        top_item->setFlags(top_item->flags() & ~Qt::ItemIsSelectable);
+        auto* top_item = new_group_item(i, duplicates[i][0], duplicates[i].size());
         ui->treeWidget->addTopLevelItem(top_item);
         for (auto& duplicate : duplicates[i]) {
             auto* item = new QTreeWidgetItem();
@@ -111,14 +140,130 @@ void main_window::finish_scan(std::vector<std::vector<std::filesystem::path>> du
             top_item->addChild(item);
         }
     }
+    show_results(!duplicates.empty());
+}
+
+void main_window::finish_scan_on_disk(std::shared_ptr<group_store> duplicates) {
+    popup->close();
+    stored_groups = std::move(duplicates);
+    ui->treeWidget->setUpdatesEnabled(false);
+    ui->treeWidget->clear();
+    try {
+        add_group_page(0, 0);
+    } catch (std::exception& ex) {
+        error(ex.what());
+    }
+    show_results(stored_groups->group_count() > 0);
+}
+
+QTreeWidgetItem* main_window::new_group_item(std::size_t index, fs::path const& head, std::size_t count) {
+    auto* top_item = new QTreeWidgetItem();
+    top_item->setText(0, QString("Group %1 (%2), files: %3, size of each: %4 bytes").
+    arg(std::to_string(index + 1).c_str(), head.filename().c_str(),
+            std::to_string(count).c_str(), std::to_string(fs::file_size(head)).c_str()));
+    top_item->setFlags(top_item->flags() & ~Qt::ItemIsSelectable);
+    return top_item;
+}
+
+// Inserts the top-level rows of up to page_size stored groups at `position`, followed by a
+// "more" row if groups are left. Their files are only read once a group is expanded.
+void main_window::add_group_page(int position, std::uint64_t first) {
+    auto count = stored_groups->group_count();
+    auto end = std::min<std::uint64_t>(first + page_size, count);
+    for (auto group = first; group < end; ++group) {
+        auto* item = new_group_item(group, stored_groups->files(group, 0, 1).front(), stored_groups->group_size(group));
+        item->setData(0, group_role, QVariant::fromValue<qulonglong>(group));
+        item->setChildIndicatorPolicy(QTreeWidgetItem::ShowIndicator);
+        ui->treeWidget->insertTopLevelItem(position++, item);
+    }
+    if (end < count) {
+        auto* more = new QTreeWidgetItem();
+        more->setText(0, QString("%1 more groups, double-click to show").arg(std::to_string(count - end).c_str()));
+        more->setData(0, more_role, QVariant::fromValue<qulonglong>(end));
+        more->setFlags(more->flags() & ~Qt::ItemIsSelectable);
+        ui->treeWidget->insertTopLevelItem(position, more);
+    }
+}
+
+void main_window::add_file_page(QTreeWidgetItem* group_item, std::uint64_t from) {
+    auto group = group_item->data(0, group_role).toULongLong();
+    auto size = stored_groups->group_size(group);
+    for (auto& file : stored_groups->files(group, from, page_size)) {
+        auto* item = new QTreeWidgetItem();
+        item->setText(0, file.c_str());
+        group_item->addChild(item);
+    }
+    if (from + page_size < size) {
+        auto* more = new QTreeWidgetItem();
+        more->setText(0, QString("%1 more files, double-click to show").arg(std::to_string(size - from - page_size).c_str()));
+        more->setData(0, more_role, QVariant::fromValue<qulonglong>(from + page_size));
+        more->setFlags(more->flags() & ~Qt::ItemIsSelectable);
+        group_item->addChild(more);
+    }
+}
+
+void main_window::load_group(QTreeWidgetItem* item) {
+    if (!stored_groups || !item->data(0, group_role).isValid() || item->childCount() > 0) {
+        return;
+    }
+    try {
+        add_file_page(item, 0);
+    } catch (std::exception& ex) {
+        error(ex.what());
+    }
+}
+
+void main_window::load_more(QTreeWidgetItem* item) {
+    if (!stored_groups || !item->data(0, more_role).isValid()) {
+        return;
+    }
+    auto next = item->data(0, more_role).toULongLong();
+    auto* parent = item->parent();
+    auto position = ui->treeWidget->indexOfTopLevelItem(item);
+    delete item;
+    try {
+        if (parent) {
+            add_file_page(parent, next);
+        } else {
+            add_group_page(position, next);
+        }
+    } catch (std::exception& ex) {
+        error(ex.what());
+    }
+}
+
+void main_window::show_results(bool enable) {
+    for (auto& partial : partial_duplicates) {
+        auto* item = new QTreeWidgetItem();
+        if (partial.files.size() == 2) {
+            item->setText(0, QString("Partial duplicates, shared: ~%1 bytes: %2, %3").
+            arg(std::to_string(partial.shared_bytes).c_str(), partial.files[0].c_str(), partial.files[1].c_str()));
+        } else {
+            // Too many files share these chunks to list them in pairs.
+            item->setText(0, QString("Partial duplicates, files: %1, shared by all: ~%2 bytes").
+            arg(std::to_string(partial.files.size()).c_str(), std::to_string(partial.shared_bytes).c_str()));
+            for (auto& file : partial.files) {
+                auto* child = new QTreeWidgetItem();
+                child->setText(0, file.c_str());
+                child->setFlags(child->flags() & ~Qt::ItemIsSelectable);
+                item->addChild(child);
+            }
+        }
+        item->setFlags(item->flags() & ~Qt::ItemIsSelectable);
+        ui->treeWidget->addTopLevelItem(item);
+    }
+    partial_duplicates.clear();
     ui->treeWidget->setUpdatesEnabled(true);
-    bool enable = !duplicates.empty();
     ui->expandAllButton->setEnabled(enable);
     ui->collapseAllButton->setEnabled(enable);
     ui->autoselectButton->setEnabled(enable);
     ui->deleteButton->setEnabled(false);
 }
 
+void main_window::store_partial_duplicates(std::vector<shared_chunks> found) {
+    partial_duplicates = std::move(found);
+}
+
 void main_window::error(QString err)
 {
     error_popup->ui->textBrowser->setText(err);
@@ -133,7 +278,13 @@ void main_window::scan_error(QString err)
 
 void main_window::expand_all()
 {
+    // expandAll() does not report the rows it expands, so stored groups are loaded here.
+    ui->treeWidget->setUpdatesEnabled(false);
+    for (int i = 0; i < ui->treeWidget->topLevelItemCount(); ++i) {
+        load_group(ui->treeWidget->topLevelItem(i));
+    }
     ui->treeWidget->expandAll();
+    ui->treeWidget->setUpdatesEnabled(true);
 }
 
 void main_window::collapse_all()
@@ -150,7 +301,7 @@ void main_window::autoselect()
             if (top_item->childCount() > 0) {
                 top_item->child(0)->setSelected(false);
                 for (int j = 1; j < top_item->childCount(); ++j) {
-                    top_item->child(j)->setSelected(true);
+                    top_item->child(j)->setSelected(top_item->child(j)->flags() & Qt::ItemIsSelectable);
                 }
             }
         } else {
@@ -233,3 +384,19 @@ void main_window::filter_state_changed()
     ui->filterRegexLabel->setEnabled(filterEnabled);
     validate();
 }
+
+void main_window::memory_limit_state_changed()
+{
+    bool limitEnabled = ui->memoryLimitFlag->checkState();
+    ui->memoryLimit->setEnabled(limitEnabled);
+    ui->spillDir->setEnabled(limitEnabled);
+    ui->changeSpillDirButton->setEnabled(limitEnabled);
+}
+
+void main_window::change_spill_dir()
+{
+    QString dir = QFileDialog::getExistingDirectory(this, tr("Choose Spill Directory"), ui->spillDir->text());
+    if (!dir.isEmpty()) {
+        ui->spillDir->setText(dir);
+    }
+}
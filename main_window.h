@@ -2,6 +2,7 @@
 #define MAIN_WINDOW_H
 
 #include <QMainWindow>
+#include <QTreeWidgetItem>
 
 #include <memory>
 #include <filesystem>
@@ -10,6 +11,9 @@
 #include "error_popup_window.h"
 #include "delete_popup_window.h"
 
+#include "chunk_analysis.h"
+#include "external_storage.h"
+
 namespace Ui {
 class main_window;
 }
@@ -31,10 +35,18 @@ private:
 
     QThread* scanning_thread = nullptr;
 
+    std::vector<shared_chunks> partial_duplicates;
+    // Results of a memory-limited scan, shown a page of rows at a time.
+    std::shared_ptr<group_store> stored_groups;
+
     bool is_dir_valid = true;
     bool is_regex_valid = true;
 
     void validate();
+    QTreeWidgetItem* new_group_item(std::size_t index, std::filesystem::path const& head, std::size_t count);
+    void add_group_page(int position, std::uint64_t first);
+    void add_file_page(QTreeWidgetItem* group_item, std::uint64_t from);
+    void show_results(bool enable);
 
 private slots:
     void scan();
@@ -43,8 +55,14 @@ private slots:
     void validate_dir();
     void validate_regex();
     void filter_state_changed();
+    void memory_limit_state_changed();
+    void change_spill_dir();
     void scan_error(QString err);
+    void store_partial_duplicates(std::vector<shared_chunks> found);
     void finish_scan(std::vector<std::vector<std::filesystem::path>> duplicates);
+    void finish_scan_on_disk(std::shared_ptr<group_store> duplicates);
+    void load_group(QTreeWidgetItem* item);
+    void load_more(QTreeWidgetItem* item);
     void expand_all();
     void collapse_all();
     void autoselect();
@@ -0,0 +1,444 @@
+#include "shard_index.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+#include <QtCore>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+    constexpr char index_magic[8] = {'D', 'F', 'I', 'N', 'D', 'E', 'X', '2'};
+
+    constexpr std::uintmax_t partial_bytes = 4096;
+
+    enum entry_flags : std::uint8_t {
+        has_partial = 1u << 0u,
+        has_full = 1u << 1u,
+    };
+
+    template<typename T>
+    void write_value(std::ofstream& fout, T const& value)
+    {
+        fout.write(reinterpret_cast<char const*>(&value), sizeof(value));
+    }
+
+    template<typename T>
+    T read_value(std::ifstream& fin)
+    {
+        T value{};
+        fin.read(reinterpret_cast<char*>(&value), sizeof(value));
+        return value;
+    }
+
+    void write_string(std::ofstream& fout, std::string const& value)
+    {
+        write_value<std::uint32_t>(fout, static_cast<std::uint32_t>(value.size()));
+        fout.write(value.data(), static_cast<std::streamsize>(value.size()));
+    }
+
+    std::string read_string(std::ifstream& fin)
+    {
+        std::string value(read_value<std::uint32_t>(fin), '\0');
+        fin.read(value.data(), static_cast<std::streamsize>(value.size()));
+        return value;
+    }
+
+    // An entry of shard `shard`, with where this host finds it and the label of its root.
+    template<typename Entry>
+    struct located_entry {
+        Entry* entry;
+        std::size_t shard;
+        std::string const* host;
+        std::string const* label;
+        fs::path path;
+    };
+
+    template<typename Index>
+    auto locate(Index& index, std::size_t shard, root_locations const& locations)
+    {
+        using entry_type = std::remove_reference_t<decltype(index.entries.front())>;
+        std::vector<fs::path> bases;
+        for (auto& root : index.roots) {
+            auto location = locations.find(root.label);
+            bases.push_back(location != locations.end() ? location->second : root.path);
+        }
+        std::vector<located_entry<entry_type>> located;
+        for (auto& entry : index.entries) {
+            if (entry.root >= bases.size()) {
+                throw std::runtime_error("Index entry \"" + entry.path.string() + "\" refers to a missing root");
+            }
+            located.push_back({&entry, shard, &index.host, &index.roots[entry.root].label, bases[entry.root] / entry.path});
+        }
+        return located;
+    }
+
+    template<typename Shards>
+    auto locate_all(Shards& shards, root_locations const& locations)
+    {
+        decltype(locate(shards.front(), 0, locations)) located;
+        for (std::size_t i = 0; i < shards.size(); ++i) {
+            auto shard = locate(shards[i], i, locations);
+            located.insert(located.end(), shard.begin(), shard.end());
+        }
+        return located;
+    }
+
+    // Every located entry, except that a file recorded by several shards under the same root
+    // label, and the hard links of a file on one host, are kept once.
+    template<typename Located>
+    std::vector<Located*> distinct_entries(std::vector<Located>& located)
+    {
+        std::vector<Located*> entries;
+        for (auto& entry : located) {
+            entries.push_back(&entry);
+        }
+        std::sort(entries.begin(), entries.end(), [](Located* a, Located* b) {
+            return std::tie(*a->label, a->entry->path) < std::tie(*b->label, b->entry->path);
+        });
+        entries.erase(std::unique(entries.begin(), entries.end(), [](Located* a, Located* b) {
+            return *a->label == *b->label && a->entry->path == b->entry->path;
+        }), entries.end());
+        std::stable_sort(entries.begin(), entries.end(), [](Located* a, Located* b) {
+            return std::tie(*a->host, a->entry->device, a->entry->inode)
+                    < std::tie(*b->host, b->entry->device, b->entry->inode);
+        });
+        entries.erase(std::unique(entries.begin(), entries.end(), [](Located* a, Located* b) {
+            // Zeros mean that the platform gave no identity.
+            return (a->entry->device != 0 || a->entry->inode != 0) && *a->host == *b->host
+                    && a->entry->device == b->entry->device && a->entry->inode == b->entry->inode;
+        }), entries.end());
+        return entries;
+    }
+
+    // Digests needed next to split size classes: a partial digest of the head for every file
+    // that shares its size, then a full digest for files whose heads collide as well.
+    // Digests that are already present are kept. Empty once the classes are fully resolved.
+    template<typename Located>
+    std::vector<std::pair<Located*, bool>> next_round(std::vector<Located*> entries)
+    {
+        std::sort(entries.begin(), entries.end(), [](Located* a, Located* b) {
+            return a->entry->size < b->entry->size;
+        });
+        std::vector<std::pair<Located*, bool>> pending;
+        for (auto first = entries.begin(); first != entries.end();) {
+            auto last = std::find_if(first, entries.end(), [size = (*first)->entry->size](Located* located) {
+                return located->entry->size != size;
+            });
+            if (last - first > 1) {
+                bool partials_missing = false;
+                for (auto it = first; it != last; ++it) {
+                    if (!(*it)->entry->partial) {
+                        pending.emplace_back(*it, false);
+                        partials_missing = true;
+                    }
+                }
+                if (!partials_missing && (*first)->entry->size > partial_bytes) {
+                    std::vector<Located*> by_partial(first, last);
+                    std::stable_sort(by_partial.begin(), by_partial.end(), [](Located* a, Located* b) {
+                        return *a->entry->partial < *b->entry->partial;
+                    });
+                    for (size_t i = 0; i < by_partial.size(); ++i) {
+                        auto& partial = *by_partial[i]->entry->partial;
+                        bool collides = (i > 0 && *by_partial[i - 1]->entry->partial == partial)
+                                || (i + 1 < by_partial.size() && *by_partial[i + 1]->entry->partial == partial);
+                        if (collides && !by_partial[i]->entry->full) {
+                            pending.emplace_back(by_partial[i], true);
+                        }
+                    }
+                }
+            }
+            first = last;
+        }
+        return pending;
+    }
+
+    using pending_digests = std::vector<std::pair<located_entry<index_entry>*, bool>>;
+
+    // Files no longer than the partial block get their full digest together with the partial one.
+    void compute_digests(pending_digests const& pending)
+    {
+        std::atomic_size_t next{0};
+        std::mutex mtx;
+        std::exception_ptr ex_ptr;
+        auto worker = [&]() {
+            try {
+                for (size_t i; (i = next++) < pending.size();) {
+                    auto [located, full] = pending[i];
+                    auto& entry = *located->entry;
+                    if (full) {
+                        entry.full = sha256(located->path);
+                    } else {
+                        entry.partial = sha256(located->path, partial_bytes);
+                        if (entry.size <= partial_bytes) {
+                            entry.full = entry.partial;
+                        }
+                    }
+                }
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lg(mtx);
+                if (!ex_ptr) {
+                    ex_ptr = std::current_exception();
+                }
+                next = pending.size();
+            }
+        };
+        const auto thread_count = std::max(std::min(std::thread::hardware_concurrency(), 4u), 1u);
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < thread_count; ++i) {
+            threads.emplace_back(worker);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        if (ex_ptr) {
+            std::rethrow_exception(ex_ptr);
+        }
+    }
+
+    void complete_digests(std::vector<located_entry<index_entry>*> const& entries)
+    {
+        for (auto pending = next_round(entries); !pending.empty(); pending = next_round(entries)) {
+            compute_digests(pending);
+        }
+    }
+
+}
+
+bool owns_directory(shard_spec const& shard, fs::path const& relative_dir)
+{
+    // FNV-1a rather than std::hash, so that every host agrees on the partition.
+    std::uint64_t hash = 14695981039346656037ull;
+    for (auto c : relative_dir.lexically_normal().generic_string()) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash % shard.count == shard.index;
+}
+
+index_root parse_root(std::string const& spec)
+{
+    auto equals = spec.find('=');
+    if (equals == std::string::npos) {
+        auto path = fs::weakly_canonical(spec);
+        auto label = (path.has_filename() ? path : path.parent_path()).filename().string();
+        return {label.empty() ? path.generic_string() : label, spec};
+    }
+    if (equals == 0) {
+        throw std::invalid_argument("Root label should not be empty in \"" + spec + "\"");
+    }
+    return {spec.substr(0, equals), spec.substr(equals + 1)};
+}
+
+shard_index scan_shard(std::vector<index_root> const& roots, std::optional<std::regex> const& filter,
+        shard_spec const& shard)
+{
+    if (shard.count == 0 || shard.index >= shard.count) {
+        throw std::invalid_argument("Shard index should be less than shard count");
+    }
+    if (shard.depth == 0) {
+        throw std::invalid_argument("Shard depth should be positive");
+    }
+    shard_index index{QSysInfo::machineHostName().toStdString(), {}, {}};
+    for (auto& root : roots) {
+        if (!fs::is_directory(root.path)) {
+            throw std::invalid_argument("Provided path should refer to a directory");
+        }
+        for (auto& other : index.roots) {
+            if (other.label == root.label) {
+                throw std::invalid_argument("Root label \"" + root.label + "\" is given twice");
+            }
+        }
+        auto base = fs::weakly_canonical(root.path);
+        auto root_id = static_cast<std::uint32_t>(index.roots.size());
+        index.roots.push_back({root.label, base});
+        fs::path owned_dir;
+        bool owned = false;
+        for (auto it = fs::recursive_directory_iterator(base); it != fs::recursive_directory_iterator(); ++it) {
+            auto depth = static_cast<unsigned>(it.depth());
+            if (it->is_directory()) {
+                // Subtrees from `depth` down belong to a single shard; the others need not walk them.
+                if (depth + 1 == shard.depth && !owns_directory(shard, it->path().lexically_relative(base))) {
+                    it.disable_recursion_pending();
+                }
+                continue;
+            }
+            if (!it->is_regular_file()) {
+                continue;
+            }
+            if (auto parent = it->path().parent_path(); parent != owned_dir) {
+                owned_dir = parent;
+                owned = depth >= shard.depth || owns_directory(shard, parent.lexically_relative(base));
+            }
+            if (owned && (!filter.has_value() || std::regex_match(it->path().string(), *filter))) {
+                auto [device, inode] = file_identity(it->path());
+                index.entries.push_back({it->file_size(), device, inode, std::nullopt, std::nullopt, root_id,
+                                         it->path().lexically_relative(base)});
+            }
+        }
+    }
+    auto located = locate(index, 0, {});
+    complete_digests(distinct_entries(located));
+    return index;
+}
+
+void write_index(fs::path const& file, shard_index const& index)
+{
+    std::ofstream fout(file, std::ios::binary | std::ios::trunc);
+    if (!fout) {
+        throw std::runtime_error("Could not create index \"" + file.string() + "\"");
+    }
+    fout.write(index_magic, sizeof(index_magic));
+    write_string(fout, index.host);
+    write_value<std::uint32_t>(fout, static_cast<std::uint32_t>(index.roots.size()));
+    for (auto& root : index.roots) {
+        write_string(fout, root.label);
+        write_string(fout, root.path.generic_string());
+    }
+    write_value<std::uint64_t>(fout, index.entries.size());
+    for (auto& entry : index.entries) {
+        write_value<std::uint64_t>(fout, entry.size);
+        write_value<std::uint64_t>(fout, entry.device);
+        write_value<std::uint64_t>(fout, entry.inode);
+        auto flags = static_cast<std::uint8_t>((entry.partial ? has_partial : 0) | (entry.full ? has_full : 0));
+        write_value(fout, flags);
+        if (entry.partial) {
+            write_value(fout, *entry.partial);
+        }
+        if (entry.full) {
+            write_value(fout, *entry.full);
+        }
+        write_value(fout, entry.root);
+        write_string(fout, entry.path.generic_string());
+    }
+    fout.close();
+    if (!fout) {
+        throw std::runtime_error("Could not write index \"" + file.string() + "\"");
+    }
+}
+
+shard_index read_index(fs::path const& file)
+{
+    std::ifstream fin(file, std::ios::binary);
+    char magic[sizeof(index_magic)] = {};
+    fin.read(magic, sizeof(magic));
+    if (!fin || !std::equal(std::begin(magic), std::end(magic), std::begin(index_magic))) {
+        throw std::runtime_error("\"" + file.string() + "\" is not a duplicate index");
+    }
+    shard_index index;
+    index.host = read_string(fin);
+    auto root_count = read_value<std::uint32_t>(fin);
+    for (std::uint32_t i = 0; i < root_count && fin; ++i) {
+        auto label = read_string(fin);
+        index.roots.push_back({label, read_string(fin)});
+    }
+    auto count = read_value<std::uint64_t>(fin);
+    for (std::uint64_t i = 0; i < count && fin; ++i) {
+        index_entry entry{};
+        entry.size = read_value<std::uint64_t>(fin);
+        entry.device = read_value<std::uint64_t>(fin);
+        entry.inode = read_value<std::uint64_t>(fin);
+        auto flags = read_value<std::uint8_t>(fin);
+        if (flags & has_partial) {
+            entry.partial = read_value<sha256_digest>(fin);
+        }
+        if (flags & has_full) {
+            entry.full = read_value<sha256_digest>(fin);
+        }
+        entry.root = read_value<std::uint32_t>(fin);
+        entry.path = read_string(fin);
+        index.entries.push_back(std::move(entry));
+    }
+    if (!fin) {
+        throw std::runtime_error("Index \"" + file.string() + "\" is truncated");
+    }
+    return index;
+}
+
+std::vector<std::vector<digest_request>> missing_digests(std::vector<shard_index> const& shards)
+{
+    std::vector<std::vector<digest_request>> requests(shards.size());
+    auto located = locate_all(shards, {});
+    for (auto [entry, full] : next_round(distinct_entries(located))) {
+        auto& entries = shards[entry->shard].entries;
+        requests[entry->shard].push_back({static_cast<size_t>(entry->entry - entries.data()), full});
+    }
+    return requests;
+}
+
+void fill_digests(shard_index& index, std::vector<digest_request> const& requests, root_locations const& locations)
+{
+    auto located = locate(index, 0, locations);
+    pending_digests pending;
+    for (auto& request : requests) {
+        if (request.entry >= located.size()) {
+            throw std::out_of_range("Digest request refers to entry " + std::to_string(request.entry)
+                    + " of an index with " + std::to_string(located.size()) + " entries");
+        }
+        pending.emplace_back(&located[request.entry], request.full);
+    }
+    compute_digests(pending);
+}
+void write_requests(fs::path const& file, std::vector<digest_request> const& requests)
+{
+    std::ofstream fout(file, std::ios::trunc);
+    for (auto& request : requests) {
+        fout << (request.full ? "full " : "partial ") << request.entry << '\n';
+    }
+    fout.close();
+    if (!fout) {
+        throw std::runtime_error("Could not write requests \"" + file.string() + "\"");
+    }
+}
+
+std::vector<digest_request> read_requests(fs::path const& file)
+{
+    std::ifstream fin(file);
+    if (!fin) {
+        throw std::runtime_error("Could not read requests \"" + file.string() + "\"");
+    }
+    std::vector<digest_request> requests;
+    std::string kind;
+    std::size_t entry;
+    while (fin >> kind >> entry) {
+        requests.push_back({entry, kind == "full"});
+    }
+    return requests;
+}
+
+std::vector<std::vector<fs::path>> merge_indices(std::vector<shard_index> shards, root_locations const& locations)
+{
+    auto located = locate_all(shards, locations);
+    auto entries = distinct_entries(located);
+    complete_digests(entries);
+
+    auto hashed = std::partition(entries.begin(), entries.end(), [](located_entry<index_entry>* located) {
+        return located->entry->full.has_value();
+    });
+    std::sort(entries.begin(), hashed, [](located_entry<index_entry>* a, located_entry<index_entry>* b) {
+        return std::tie(a->entry->size, *a->entry->full, a->path) < std::tie(b->entry->size, *b->entry->full, b->path);
+    });
+    std::vector<std::vector<fs::path>> duplicates;
+    for (auto first = entries.begin(); first != hashed;) {
+        auto last = std::find_if(first, hashed, [&first](located_entry<index_entry>* located) {
+            return located->entry->size != (*first)->entry->size || *located->entry->full != *(*first)->entry->full;
+        });
+        if (last - first > 1) {
+            std::vector<fs::path> files;
+            for (auto it = first; it != last; ++it) {
+                files.push_back((*it)->path);
+            }
+            duplicates.push_back(std::move(files));
+        }
+        first = last;
+    }
+    return duplicates;
+}
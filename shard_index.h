@@ -0,0 +1,89 @@
+#ifndef SHARD_INDEX_H
+#define SHARD_INDEX_H
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "file_digest.h"
+
+// A scanned root. Shards that scan the same namespace give it the same label, wherever
+// their host mounts it; paths in the index are relative to the root.
+struct index_root {
+    std::string label;
+    std::filesystem::path path;
+};
+
+// One file as recorded by a shard. Digests are only present where some shard had to
+// compute them; merging asks for the rest.
+struct index_entry {
+    std::uintmax_t size;
+    std::uint64_t device;
+    std::uint64_t inode;
+    std::optional<sha256_digest> partial;
+    std::optional<sha256_digest> full;
+    std::uint32_t root;
+    std::filesystem::path path;
+};
+
+// What one shard recorded. (device, inode) pairs only identify a file on the host that
+// recorded them, so hard links are recognized per host.
+struct shard_index {
+    std::string host;
+    std::vector<index_root> roots;
+    std::vector<index_entry> entries;
+};
+
+// Where the host running fill or merge finds each root label. Labels not listed are looked
+// for where the scanning host found them.
+using root_locations = std::map<std::string, std::filesystem::path>;
+
+// Shard `index` of `count`. Directories are assigned by hashing their path relative to the
+// scanned root, so hosts that mount the share elsewhere still agree on the split. Below
+// `depth` a directory's whole subtree goes with it, so that other shards can skip it.
+struct shard_spec {
+    unsigned index;
+    unsigned count;
+    unsigned depth = 2;
+};
+
+// A digest that a shard still has to compute for its own entry at `entry`.
+struct digest_request {
+    std::size_t entry;
+    bool full;
+};
+
+bool owns_directory(shard_spec const& shard, std::filesystem::path const& relative_dir);
+
+// Parses `LABEL=PATH`, or a bare PATH labelled with its directory name.
+index_root parse_root(std::string const& spec);
+
+shard_index scan_shard(std::vector<index_root> const& roots, std::optional<std::regex> const& filter,
+        shard_spec const& shard);
+
+void write_index(std::filesystem::path const& file, shard_index const& index);
+
+shard_index read_index(std::filesystem::path const& file);
+
+// Digests each shard has to add before the shards can be merged, empty once nothing is missing.
+// Needs at most two rounds: partial digests for cross-shard size collisions, then full
+// digests for the partial collisions among them.
+std::vector<std::vector<digest_request>> missing_digests(std::vector<shard_index> const& shards);
+
+// Computes the requested digests in parallel.
+void fill_digests(shard_index& index, std::vector<digest_request> const& requests, root_locations const& locations);
+
+void write_requests(std::filesystem::path const& file, std::vector<digest_request> const& requests);
+
+std::vector<digest_request> read_requests(std::filesystem::path const& file);
+
+// Final duplicate groups, as paths on this host. Digests still missing are computed here,
+// which needs every root reachable from this host. Hard links of one file count once.
+std::vector<std::vector<std::filesystem::path>>
+merge_indices(std::vector<shard_index> shards, root_locations const& locations);
+
+#endif // SHARD_INDEX_H
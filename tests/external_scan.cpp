@@ -0,0 +1,155 @@
+// Runs the out-of-core scan with a memory limit small enough for several spill and merge
+// passes, and checks it against the in-memory scan.
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+
+#include "external_storage.h"
+#include "find_duplicates.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+    int failures = 0;
+
+    void check(bool condition, std::string const& what)
+    {
+        if (!condition) {
+            std::cerr << "FAILED: " << what << std::endl;
+            ++failures;
+        }
+    }
+
+    struct test_record {
+        std::uint64_t key;
+        std::uint64_t sequence;
+
+        bool operator<(test_record const& other) const {
+            return std::tie(key, sequence) < std::tie(other.key, other.sequence);
+        }
+
+        bool operator==(test_record const& other) const {
+            return key == other.key && sequence == other.sequence;
+        }
+    };
+
+    void write_file(fs::path const& file, std::string const& content)
+    {
+        fs::create_directories(file.parent_path());
+        std::ofstream(file, std::ios::binary) << content;
+    }
+
+    // Duplicates of many sizes spread over nested directories, plus empty files and
+    // same-size files that differ only in their last byte.
+    void make_tree(fs::path const& root)
+    {
+        std::mt19937_64 gen(42);
+        auto random_content = [&gen](std::size_t size) {
+            std::string content(size, '\0');
+            for (auto& c : content) {
+                c = static_cast<char>(gen());
+            }
+            return content;
+        };
+        for (int i = 0; i < 3000; ++i) {
+            auto dir = root / ("d" + std::to_string(i % 37)) / ("e" + std::to_string(i % 5));
+            auto content = random_content(static_cast<std::size_t>(gen() % 20000));
+            write_file(dir / ("f" + std::to_string(i)), content);
+            if (i % 3 == 0) {
+                write_file(root / ("copy" + std::to_string(i % 11)) / ("f" + std::to_string(i)), content);
+            }
+            if (i % 7 == 0 && !content.empty()) {
+                content.back() = static_cast<char>(content.back() + 1);
+                write_file(dir / ("near" + std::to_string(i)), content);
+            }
+        }
+        for (int i = 0; i < 500; ++i) {
+            write_file(root / "empty" / ("e" + std::to_string(i)), "");
+        }
+    }
+
+    std::set<std::set<fs::path>> normalized(std::vector<std::vector<fs::path>> const& groups)
+    {
+        std::set<std::set<fs::path>> result;
+        for (auto& group : groups) {
+            result.emplace(group.begin(), group.end());
+        }
+        return result;
+    }
+
+    void test_sorter(fs::path const& dir)
+    {
+        // 1024 records per run and a fan-in of two: 98 runs, merged in several passes.
+        external_sorter<test_record> sorter(dir / "sorter", 1024 * sizeof(test_record));
+        std::vector<test_record> expected;
+        std::mt19937_64 gen(7);
+        for (std::uint64_t i = 0; i < 100000; ++i) {
+            expected.push_back({gen() % 5000, i});
+            sorter.push(expected.back());
+        }
+        std::sort(expected.begin(), expected.end());
+        std::vector<test_record> merged;
+        sorter.merge([&merged](test_record const& record) {
+            merged.push_back(record);
+        });
+        check(merged == expected, "external_sorter returns every record in order");
+        check(fs::is_empty(dir / "sorter"), "external_sorter removes its runs");
+    }
+
+    void test_group_store(fs::path const& dir)
+    {
+        group_store groups(dir);
+        for (int group = 0; group < 3; ++group) {
+            for (int file = 0; file <= group * 1000; ++file) {
+                groups.add(std::to_string(group) + "/" + std::to_string(file), file == 0);
+            }
+        }
+        check(groups.group_count() == 3, "group_store counts groups");
+        check(groups.group_size(2) == 2001, "group_store counts files of a group");
+        auto page = groups.files(2, 1990, 100);
+        check(page.size() == 11 && page.front() == "2/1990" && page.back() == "2/2000",
+                "group_store pages through a group");
+    }
+
+}
+
+int main()
+{
+    auto dir = fs::temp_directory_path() / ("external_scan_test-" + std::to_string(std::random_device()()));
+    fs::create_directories(dir / "spill");
+    try {
+        test_sorter(dir);
+        test_group_store(dir);
+
+        make_tree(dir / "tree");
+        auto start = std::chrono::steady_clock::now();
+        auto in_memory = find_duplicates(dir / "tree", std::nullopt, [](int) {}, [](int) {});
+        auto middle = std::chrono::steady_clock::now();
+        auto external = find_duplicates(dir / "tree", std::nullopt, [](int) {}, [](int) {},
+                external_memory_options{64 * 1024, dir / "spill"});
+        auto end = std::chrono::steady_clock::now();
+        check(!in_memory.empty(), "the tree has duplicates");
+        check(normalized(in_memory) == normalized(external), "out-of-core groups match the in-memory ones");
+        check(fs::is_empty(dir / "spill"), "the spill directory is removed");
+
+        chunk_analysis analysis;
+        auto analysed = find_duplicates(dir / "tree", std::nullopt, [](int) {}, [](int) {},
+                external_memory_options{64 * 1024, dir / "spill"}, &analysis);
+        check(normalized(in_memory) == normalized(analysed), "analysis does not change the groups");
+
+        std::cout << "in-memory: " << std::chrono::duration<double>(middle - start).count() << " s, "
+                  << "out-of-core: " << std::chrono::duration<double>(end - middle).count() << " s, "
+                  << in_memory.size() << " groups" << std::endl;
+    } catch (std::exception& ex) {
+        check(false, ex.what());
+    }
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+// Feeds versions of an appended log, and files too large for their share of a small memory
+// limit, to the chunk analysis and checks what it reports.
+
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+
+#include "chunk_analysis.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+    int failures = 0;
+
+    void check(bool condition, std::string const& what)
+    {
+        if (!condition) {
+            std::cerr << "FAILED: " << what << std::endl;
+            ++failures;
+        }
+    }
+
+    std::string random_content(std::mt19937_64& gen, std::size_t size)
+    {
+        std::string content(size, '\0');
+        for (auto& c : content) {
+            c = static_cast<char>(gen());
+        }
+        return content;
+    }
+
+    // Stands in for the SHA-256 of the content; only equality matters to the analysis.
+    sha256_digest digest(std::string const& content)
+    {
+        sha256_digest result{};
+        for (std::size_t i = 0; i < result.size(); i += sizeof(std::size_t)) {
+            auto h = std::hash<std::string>()(content + static_cast<char>(i));
+            std::memcpy(result.data() + i, &h, sizeof(h));
+        }
+        return result;
+    }
+
+    void add(chunk_analysis& analysis, std::string const& name, std::string const& content)
+    {
+        content_defined_chunker chunker;
+        chunk_analysis::file_chunks chunks(analysis);
+        auto on_chunk = [&chunks](std::uint64_t fingerprint, std::size_t length) {
+            chunks.add(fingerprint, length);
+        };
+        for (std::size_t offset = 0; offset < content.size(); offset += 64 * 1024) {
+            chunker.update(content.data() + offset, std::min<std::size_t>(64 * 1024, content.size() - offset), on_chunk);
+        }
+        chunker.finish(on_chunk);
+        analysis.add_file(name, digest(content), std::move(chunks));
+    }
+
+    bool reported_together(std::vector<shared_chunks> const& report, fs::path const& a, fs::path const& b)
+    {
+        for (auto& row : report) {
+            std::set<fs::path> files(row.files.begin(), row.files.end());
+            if (files.count(a) != 0 && files.count(b) != 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Every version shares its whole head with all later ones, far more files than are paired up.
+    void test_appended_log()
+    {
+        constexpr int versions = 20;
+        std::mt19937_64 gen(11);
+        std::string log;
+        for (int line = 0; log.size() < (1u << 20u) + versions * 128 * 1024; ++line) {
+            log += "entry " + std::to_string(line) + " value " + std::to_string(gen()) + "\n";
+        }
+        chunk_analysis analysis({256u << 20u, 256 * 1024});
+        for (int version = 0; version < versions; ++version) {
+            add(analysis, "v" + std::to_string(version), log.substr(0, (1u << 20u) + version * 128 * 1024));
+        }
+        add(analysis, "v3 copy", log.substr(0, (1u << 20u) + 3 * 128 * 1024));
+        add(analysis, "unrelated", random_content(gen, 1u << 20u));
+
+        auto report = analysis.report();
+        for (int i = 0; i < versions; ++i) {
+            for (int j = i + 1; j < versions; ++j) {
+                check(reported_together(report, "v" + std::to_string(i), "v" + std::to_string(j)),
+                        "versions " + std::to_string(i) + " and " + std::to_string(j) + " are reported together");
+            }
+        }
+        bool all_versions = false;
+        for (auto& row : report) {
+            for (auto& file : row.files) {
+                check(file != "v3 copy", "identical copies are represented by the first of them");
+                check(file != "unrelated", "unrelated files are not reported");
+            }
+            all_versions |= row.files.size() == versions && row.shared_bytes >= 900 * 1024;
+        }
+        check(all_versions, "the head shared by all versions is reported as one group");
+    }
+
+    // Two large files that differ by one inserted byte, with a limit that leaves each file
+    // room for a few hundred chunks.
+    void test_small_limit()
+    {
+        std::mt19937_64 gen(5);
+        auto content = random_content(gen, 16u << 20u);
+        auto changed = content;
+        changed.insert(changed.begin() + (8 << 20), 'x');
+        chunk_analysis analysis({64 * 1024, 1u << 20u});
+        add(analysis, "a", content);
+        add(analysis, "b", changed);
+        auto report = analysis.report();
+        check(report.size() == 1 && reported_together(report, "a", "b") && report.front().shared_bytes >= (8u << 20u),
+                "large near-duplicates are found under a small limit");
+    }
+
+}
+
+int main()
+{
+    test_appended_log();
+    test_small_limit();
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,110 @@
+#!/bin/sh
+# Scans a generated tree with N concurrent `duplicate_index scan --shard i/N` processes and
+# checks the merged groups against the duplicates the tree was built with, both with the
+# merge hashing on its own and, after moving the tree as another host would mount it, with
+# the request/fill rounds.
+#     sharded_scan.sh PATH_TO_DUPLICATE_INDEX [N]
+
+set -u
+
+tool=$1
+shards=${2:-4}
+work=$(cd "$(mktemp -d)" && pwd -P)
+trap 'rm -rf "$work"' EXIT
+
+fail() {
+    echo "sharded_scan: $*" >&2
+    exit 1
+}
+
+data=$work/data
+for top in a b c d; do
+    for mid in x y z; do
+        for leaf in 1 2 3; do
+            dir=$data/$top/$mid/$leaf
+            mkdir -p "$dir"
+            printf 'small %s\n' "$leaf" > "$dir/small"
+            printf 'unique %s %s %s\n' "$top" "$mid" "$leaf" > "$dir/unique"
+        done
+        printf '%s\n' "$top$mid" > "$data/$top/$mid/shallow"
+    done
+done
+# Larger than the partial digest block: identical copies, and a file sharing only its head.
+head -c 20000 /dev/urandom > "$work/big"
+cp "$work/big" "$data/a/x/1/big"
+cp "$work/big" "$data/c/z/3/big"
+cp "$work/big" "$data/big"
+{ head -c 4096 "$work/big"; head -c 15904 /dev/urandom; } > "$data/d/y/2/same_head"
+head -c 20000 /dev/urandom > "$data/b/y/1/same_size"
+# Hard links are the same file, not duplicates of it.
+ln "$data/a/x/1/unique" "$data/b/z/2/unique_link"
+ln "$data/big" "$data/d/z/3/big_link"
+
+# The groups the tree was built with, one per line, for the tree at $1.
+expected() {
+    printf '%s|%s|%s\n' "$1/a/x/1/big" "$1/big" "$1/c/z/3/big"
+    for leaf in 1 2 3; do
+        for top in a b c d; do
+            for mid in x y z; do
+                printf '%s\n' "$1/$top/$mid/$leaf/small"
+            done
+        done | paste -sd'|' -
+    done
+}
+
+# Checks merge output in $1 against the groups of the tree at $2.
+check_groups() {
+    grep -q 'same_head\|same_size\|shallow\|unique' "$1" && fail "$3: unrelated files are grouped"
+    awk 'BEGIN { RS = "" } { gsub("\n", "|"); print }' "$1" | sort > "$1.groups"
+    expected "$2" | sort > "$work/expected"
+    cmp -s "$work/expected" "$1.groups" || fail "$3: groups differ from the ones the tree was built with"
+}
+
+"$tool" scan --shard 0/1 -o "$work/all.idx" "$data" || fail "single-shard scan failed"
+"$tool" merge "$work/all.idx" > "$work/single" || fail "single-shard merge failed"
+check_groups "$work/single" "$data" "single shard"
+
+i=0
+pids=
+while [ "$i" -lt "$shards" ]; do
+    if [ "$i" -eq 0 ]; then
+        # A relative root must partition and label the same way as an absolute one.
+        (cd "$work" && "$tool" scan --shard "$i/$shards" -o "$work/shard$i.idx" data) &
+    else
+        "$tool" scan --shard "$i/$shards" -o "$work/shard$i.idx" "$data" &
+    fi
+    pids="$pids $!"
+    i=$((i + 1))
+done
+for pid in $pids; do
+    wait "$pid" || fail "shard scan failed"
+done
+
+"$tool" merge "$work"/shard*.idx > "$work/merged" || fail "merge failed"
+check_groups "$work/merged" "$data" "merge"
+
+# Indices hold paths relative to the labelled root, so they still apply where it has moved.
+moved=$work/elsewhere
+mv "$data" "$moved"
+rounds=0
+while :; do
+    "$tool" merge --requests --root "data=$moved" "$work"/shard*.idx > "$work/requested"
+    status=$?
+    [ "$status" -eq 3 ] || break
+    rounds=$((rounds + 1))
+    [ "$rounds" -le 2 ] || fail "digests still missing after two fill rounds"
+    pids=
+    for index in "$work"/shard*.idx; do
+        if [ -f "$index.requests" ]; then
+            "$tool" fill --root "data=$moved" "$index" &
+            pids="$pids $!"
+        fi
+    done
+    for pid in $pids; do
+        wait "$pid" || fail "fill failed"
+    done
+done
+[ "$status" -eq 0 ] || fail "merge --requests failed"
+check_groups "$work/requested" "$moved" "merge after fill"
+
+echo "sharded_scan: $shards shards, $rounds fill rounds, results match"